@@ -0,0 +1,104 @@
+// Measures the latency of flucurl_session_send_request while several threads
+// submit requests at the same time.
+//
+// Build with -DFLUCURL_BUILD_BENCHMARKS=ON in src/, then run
+//   flucurl_submission_latency [threads] [requests per thread] [url]
+// against the benchmark server (benchmark/server).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "flucurl.h"
+
+using namespace std::chrono;
+
+static std::atomic<int> finished{0};
+
+static void on_response(Response response) { flucurl_free_reponse(response); }
+
+static void on_data(BodyData *data) {
+  if (!data) {
+    finished++;
+    return;
+  }
+  flucurl_free_bodydata(data);
+}
+
+static void on_error(const char *message) { finished++; }
+
+int main(int argc, char **argv) {
+  int thread_count = argc > 1 ? std::atoi(argv[1]) : 8;
+  int per_thread = argc > 2 ? std::atoi(argv[2]) : 2000;
+  const char *url = argc > 3 ? argv[3] : "http://localhost:8080/ping";
+
+  flucurl_global_init();
+  Config config = {};
+  config.timeout = 30;
+  config.http_version = HTTP1_1;
+  config.loop_mode = LOOP_SOCKET_ACTION;
+  void *session = flucurl_session_init(config);
+
+  const char *headers[] = {"User-Agent: flucurl-benchmark"};
+  std::vector<std::vector<int64_t>> latencies(thread_count);
+  std::vector<std::thread> threads;
+  std::atomic<bool> go = false;
+  for (int t = 0; t < thread_count; t++) {
+    threads.emplace_back([&, t] {
+      auto &samples = latencies[t];
+      samples.reserve(per_thread);
+      while (!go) {
+        std::this_thread::yield();
+      }
+      for (int i = 0; i < per_thread; i++) {
+        Request request = {};
+        request.url = url;
+        request.method = "GET";
+        request.headers = const_cast<char **>(headers);
+        request.header_count = 1;
+        auto start = steady_clock::now();
+        flucurl_session_send_request(session, request, on_response, on_data,
+                                     on_error, nullptr);
+        samples.push_back(
+            duration_cast<nanoseconds>(steady_clock::now() - start).count());
+      }
+    });
+  }
+
+  auto start = steady_clock::now();
+  go = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto submit_time = steady_clock::now() - start;
+
+  int total = thread_count * per_thread;
+  while (finished < total) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  auto total_time = steady_clock::now() - start;
+
+  std::vector<int64_t> all;
+  for (auto &samples : latencies) {
+    all.insert(all.end(), samples.begin(), samples.end());
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&](double p) {
+    return all[std::min<size_t>(all.size() - 1, all.size() * p)];
+  };
+  std::printf("threads: %d, requests: %d\n", thread_count, total);
+  std::printf("submit latency ns: p50 %lld, p99 %lld, p99.9 %lld, max %lld\n",
+              (long long)percentile(0.5), (long long)percentile(0.99),
+              (long long)percentile(0.999), (long long)all.back());
+  std::printf("submit phase: %lld ms, all requests done: %lld ms\n",
+              (long long)duration_cast<milliseconds>(submit_time).count(),
+              (long long)duration_cast<milliseconds>(total_time).count());
+
+  flucurl_session_terminate(session);
+  flucurl_global_deinit();
+  return 0;
+}
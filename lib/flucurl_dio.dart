@@ -23,7 +23,7 @@ class FlucurlAdapter implements HttpClientAdapter {
       method: options.method,
       headers: options.headers.map((key, value) => MapEntry(key, value.toString())),
       body: requestStream,
-    ));
+    ), cancelFuture: cancelFuture);
 
     return ResponseBody(
       response.body,
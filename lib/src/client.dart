@@ -1,6 +1,7 @@
 import 'dart:async';
 import 'dart:convert';
 import 'dart:ffi' as ffi;
+import 'dart:isolate';
 import 'dart:typed_data';
 
 import 'package:ffi/ffi.dart';
@@ -12,20 +13,160 @@ import 'package:flucurl/src/utils.dart';
 
 typedef _DNSResolver = String? Function(String host);
 
+// how a request is completed when the session dispatches events itself
+class _RequestHandlers {
+  final void Function(int statusCode, Map<String, List<String>> headers)
+      onResponse;
+  final void Function(Uint8List? chunk) onData;
+  final void Function(String message) onFail;
+
+  _RequestHandlers(this.onResponse, this.onData, this.onFail);
+}
+
+// headers holds name, name_len, value, value_len per header, offsets into
+// data, see generated.Header
+Map<String, List<String>> _parseHeaders(Int32List headers, Uint8List data) {
+  var result = <String, List<String>>{};
+  for (var i = 0; i + 3 < headers.length; i += 4) {
+    var key = utf8.decode(Uint8List.sublistView(
+        data, headers[i], headers[i] + headers[i + 1]));
+    var value = utf8.decode(Uint8List.sublistView(
+        data, headers[i + 2], headers[i + 2] + headers[i + 3]));
+    (result[key] ??= []).add(value);
+  }
+  return result;
+}
+
+Map<String, List<String>> _responseHeaders(generated.Response response) {
+  if (response.header_count == 0) {
+    return {};
+  }
+  return _parseHeaders(
+      response.headers.cast<ffi.Int32>().asTypedList(response.header_count * 4),
+      response.header_data
+          .cast<ffi.Uint8>()
+          .asTypedList(response.header_data_len));
+}
+
+// the chunk keeps the native buffer alive until it is garbage collected
+Uint8List _bodyChunk(ffi.Pointer<generated.BodyData> data) {
+  return data.ref.data.cast<ffi.Uint8>().asTypedList(data.ref.size,
+      finalizer: freeBodyData.cast(), token: data.cast());
+}
+
 class FlucurlClient {
   late ffi.Pointer<ffi.Void> session;
 
   _DNSResolver? _dnsResolver;
 
+  late final DeliveryMode _deliveryMode;
+
+  // DeliveryMode.DELIVERY_RING and DELIVERY_PORT only
+  final _pending = <int, _RequestHandlers>{};
+
+  // DeliveryMode.DELIVERY_RING only
+  static const _eventBatch = 256;
+  ffi.NativeCallable<generated.EventNotifyCallbackFunction>? _eventNotify;
+  ffi.Pointer<generated.Event> _events = ffi.nullptr;
+
+  // DeliveryMode.DELIVERY_PORT only
+  ReceivePort? _eventPort;
+
   FlucurlClient({
     FlucurlConfig config = const FlucurlConfig(),
   }) {
     _dnsResolver = config.dnsResolver;
+    _deliveryMode = config.deliveryMode;
     var nativeConfig = NativeConfig(config);
+    if (_deliveryMode == DeliveryMode.DELIVERY_RING) {
+      _eventNotify =
+          ffi.NativeCallable<generated.EventNotifyCallbackFunction>.listener(
+              _drainEvents);
+      _events = calloc<generated.Event>(_eventBatch);
+      nativeConfig.nativeConfig.ref.event_notify = _eventNotify!.nativeFunction;
+    } else if (_deliveryMode == DeliveryMode.DELIVERY_PORT) {
+      _eventPort = ReceivePort()..listen(_onPortEvent);
+      nativeConfig.nativeConfig.ref.event_port = _eventPort!.sendPort.nativePort;
+      nativeConfig.nativeConfig.ref.post_cobject =
+          ffi.NativeApi.postCObject.cast();
+    }
     session = bindings.flucurl_session_init(nativeConfig.nativeConfig.ref);
     nativeConfig.free();
   }
 
+  void _drainEvents() {
+    if (_events == ffi.nullptr) {
+      return;
+    }
+    int count;
+    do {
+      count =
+          bindings.flucurl_session_poll_events(session, _events, _eventBatch);
+      for (var i = 0; i < count; i++) {
+        var event = _events[i];
+        var handlers = _pending[event.request_id];
+        switch (generated.EventType.fromValue(event.type)) {
+          case generated.EventType.EVENT_RESPONSE:
+            var response = event.response;
+            if (handlers != null) {
+              handlers.onResponse(response.status, _responseHeaders(response));
+            }
+            bindings.flucurl_free_reponse(response);
+          case generated.EventType.EVENT_DATA:
+            if (handlers == null) {
+              if (event.data != ffi.nullptr) {
+                bindings.flucurl_free_bodydata(event.data);
+              }
+            } else {
+              handlers.onData(
+                  event.data == ffi.nullptr ? null : _bodyChunk(event.data));
+            }
+          case generated.EventType.EVENT_ERROR:
+            handlers?.onFail(event.message.cast<Utf8>().toDartString());
+        }
+      }
+    } while (count == _eventBatch);
+  }
+
+  // [request id, EventType, payload...], see DeliveryMode.DELIVERY_PORT
+  void _onPortEvent(dynamic message) {
+    var event = message as List;
+    // chunks of unknown requests are freed by their finalizers
+    var handlers = _pending[event[0] as int];
+    if (handlers == null) {
+      return;
+    }
+    switch (generated.EventType.fromValue(event[1] as int)) {
+      case generated.EventType.EVENT_RESPONSE:
+        var headers = event[4] as Uint8List;
+        handlers.onResponse(
+            event[2] as int,
+            _parseHeaders(
+                headers.buffer.asInt32List(
+                    headers.offsetInBytes, headers.lengthInBytes ~/ 4),
+                event[5] as Uint8List));
+      case generated.EventType.EVENT_DATA:
+        handlers.onData(event[2] as Uint8List?);
+      case generated.EventType.EVENT_ERROR:
+        handlers.onFail(event[2] as String);
+    }
+  }
+
+  // fails what never got its final event and frees the dispatch resources
+  void _closeEvents() {
+    for (var handlers in _pending.values.toList()) {
+      handlers.onFail('Session is shut down');
+    }
+    _eventNotify?.close();
+    _eventNotify = null;
+    if (_events != ffi.nullptr) {
+      calloc.free(_events);
+      _events = ffi.nullptr;
+    }
+    _eventPort?.close();
+    _eventPort = null;
+  }
+
   FlucurlRequest _translateRequestBody(FlucurlRequest request) {
     if (request.body is String) {
       request.headers['Content-Type'] ??= 'text/plain';
@@ -51,70 +192,74 @@ class FlucurlClient {
       request.headers['Content-Length'] ??= data.length.toString();
       return request.copyWith(body: Stream.value(Uint8List.fromList(data)));
     } else if (request.body == null) {
-      request.headers['Content-Length'] ??= '0';
+      // GET and HEAD go without, other methods announce the empty body
+      if (request.method != 'GET' && request.method != 'HEAD') {
+        request.headers['Content-Length'] ??= '0';
+      }
       return request;
     } else {
       throw ArgumentError('Invalid body type');
     }
   }
 
-  Future<FlucurlResponse> send(FlucurlRequest request) async {
+  /// Sends [request]. Completing [cancelFuture] aborts the request, the
+  /// response future or body stream then fails with an error.
+  Future<FlucurlResponse> send(FlucurlRequest request,
+      {Future<void>? cancelFuture}) async {
     request = _translateRequestBody(request);
 
-    var req = NativeRequest(request, _dnsResolver?.call(request.url));
+    var url = request.fullUrl;
+    // the resolver is asked for the host, urls without one resolve natively
+    var host = Uri.tryParse(url)?.host ?? '';
+    var req = NativeRequest(
+        request, host.isEmpty ? null : _dnsResolver?.call(host));
     var completer = Completer<FlucurlResponse>();
     var bodySink = StreamController<Uint8List>();
 
     var nativeFunctions = <ffi.NativeCallable>[];
+    var finished = false;
+    var id = 0;
 
     void clear() {
+      finished = true;
       for (var function in nativeFunctions) {
         function.close();
       }
+      _pending.remove(id);
       req.free();
     }
 
-    void onResponse(generated.Response response) {
-      var url = request.url;
-      var method = request.method;
-      var statusCode = response.status;
-      var headers = <String, List<String>>{};
-      for (int i = 0; i < response.header_count; i++) {
-        var field = ffi.Pointer<generated.Field>.fromAddress(
-            response.headers.address + i * ffi.sizeOf<generated.Field>());
-        var data = field.ref.p.cast<ffi.Uint8>().asTypedList(field.ref.len);
-        var str = utf8.decode(data);
-        if (!str.contains(':')) {
-          continue;
-        }
-        var spliter = str.indexOf(':');
-        var key = str.substring(0, spliter);
-        var value = str.substring(spliter + 1).trim();
-        headers[key] ??= [];
-        headers[key]!.add(value);
-      }
-      bindings.flucurl_free_reponse(response);
+    void respond(int statusCode, Map<String, List<String>> headers) {
       completer.complete(FlucurlResponse(
         url: url,
-        method: method,
+        method: request.method,
         statusCode: statusCode,
         headers: headers,
         body: bodySink.stream,
       ));
     }
 
-    void onData(ffi.Pointer<generated.BodyData> data) {
-      if (data == ffi.nullptr) {
+    void addChunk(Uint8List? chunk) {
+      if (chunk == null) {
         bodySink.close();
         clear();
         return;
       }
-      bodySink.add(data.ref.data.cast<ffi.Uint8>().asTypedList(data.ref.size, finalizer: freeBodyData.cast(), token: data.cast()));
+      bodySink.add(chunk);
     }
 
-    void onError(ffi.Pointer<ffi.Char> error) {
+    void onResponse(generated.Response response) {
+      var headers = _responseHeaders(response);
+      bindings.flucurl_free_reponse(response);
+      respond(response.status, headers);
+    }
+
+    void onData(ffi.Pointer<generated.BodyData> data) {
+      addChunk(data == ffi.nullptr ? null : _bodyChunk(data));
+    }
+
+    void fail(String message) {
       clear();
-      var message = error.cast<Utf8>().toDartString();
       if (completer.isCompleted) {
         bodySink.addError(message);
       } else {
@@ -122,34 +267,89 @@ class FlucurlClient {
       }
     }
 
-    var nativeResponseCallback =
-        ffi.NativeCallable<generated.ResponseCallbackFunction>.listener(
-            onResponse);
-    var nativeDataHandler =
-        ffi.NativeCallable<generated.DataHandlerFunction>.listener(onData);
-    var nativeErrorHandler =
-        ffi.NativeCallable<generated.ErrorHandlerFunction>.listener(onError);
+    void onError(ffi.Pointer<ffi.Char> error) {
+      fail(error.cast<Utf8>().toDartString());
+    }
 
-    nativeFunctions.addAll(
-        [nativeResponseCallback, nativeDataHandler, nativeErrorHandler]);
+    // ring and port delivery dispatch through _pending instead of callbacks
+    var dispatched = _deliveryMode != DeliveryMode.DELIVERY_CALLBACK;
+    generated.ResponseCallback responseCallback = ffi.nullptr;
+    generated.DataHandler dataHandler = ffi.nullptr;
+    generated.ErrorHandler errorHandler = ffi.nullptr;
+    if (!dispatched) {
+      var nativeResponseCallback =
+          ffi.NativeCallable<generated.ResponseCallbackFunction>.listener(
+              onResponse);
+      var nativeDataHandler =
+          ffi.NativeCallable<generated.DataHandlerFunction>.listener(onData);
+      var nativeErrorHandler =
+          ffi.NativeCallable<generated.ErrorHandlerFunction>.listener(onError);
+      nativeFunctions.addAll(
+          [nativeResponseCallback, nativeDataHandler, nativeErrorHandler]);
+      responseCallback = nativeResponseCallback.nativeFunction;
+      dataHandler = nativeDataHandler.nativeFunction;
+      errorHandler = nativeErrorHandler.nativeFunction;
+    }
 
+    var requestId = req.allocate<ffi.UnsignedLongLong>(
+        ffi.sizeOf<ffi.UnsignedLongLong>());
     var state = bindings.flucurl_session_send_request(
       session,
       req.nativeRequest.ref,
-      nativeResponseCallback.nativeFunction,
-      nativeDataHandler.nativeFunction,
-      nativeErrorHandler.nativeFunction,
+      responseCallback,
+      dataHandler,
+      errorHandler,
+      requestId,
     );
+    id = requestId.value;
+    if (state == ffi.nullptr) {
+      // rejected by a closing session, only callbacks report that
+      if (dispatched) {
+        fail('Session is shut down');
+      }
+      return completer.future;
+    }
+    if (dispatched) {
+      _pending[id] = _RequestHandlers(respond, addChunk, fail);
+    }
+    cancelFuture?.then((_) {
+      if (!finished) {
+        bindings.flucurl_session_cancel_request(session, id);
+      }
+    });
 
     if (request.body == null) {
       return completer.future;
     }
 
+    // a copy bound to this request, appends after it finished are refused
+    // even once the native record serves another request
+    var upload = ffi.Struct.create<generated.UploadState>();
+    upload.queue = state.ref.queue;
+    upload.request_id = id;
+
+    // hands the buffer over, it is freed natively once sent
+    bool append(ffi.Pointer<ffi.Uint8> buffer, int length) {
+      var field = ffi.Struct.create<generated.Field>();
+      field.p = buffer.cast();
+      field.len = length;
+      if (bindings.flucurl_upload_append(upload, field) == 0) {
+        NativeFreeable.freePtr(buffer);
+        return false;
+      }
+      return true;
+    }
+
     const bufferSize = 4 * 1024;
     var buffer = NativeFreeable.allocateMem<ffi.Uint8>(bufferSize);
     int writeIndex = 0;
 
     await for (var d in request.body as Stream) {
+      if (finished) {
+        // failed or cancelled, the native upload state is gone
+        NativeFreeable.freePtr(buffer);
+        return completer.future;
+      }
       assert(d is List<int>);
       var data = d as List<int>;
       int readIndex = 0;
@@ -164,26 +364,123 @@ class FlucurlClient {
         writeIndex += toWrite;
         readIndex += toWrite;
         if (writeIndex == bufferSize) {
-          var field = ffi.Struct.create<generated.Field>();
-          field.p = buffer.cast();
-          field.len = bufferSize;
-          bindings.flucurl_upload_append(state.ref, field);
+          if (!append(buffer, bufferSize)) {
+            return completer.future;
+          }
+          buffer = NativeFreeable.allocateMem<ffi.Uint8>(bufferSize);
           writeIndex = 0;
         }
       }
     }
 
-    if (writeIndex != 0) {
-      var field = ffi.Struct.create<generated.Field>();
-      field.p = buffer.cast();
-      field.len = writeIndex;
-      bindings.flucurl_upload_append(state.ref, field);
+    if (writeIndex != 0 && !finished) {
+      append(buffer, writeIndex);
+    } else {
+      NativeFreeable.freePtr(buffer);
     }
 
     return completer.future;
   }
 
+  FlucurlQueueStats queueStats(RequestPriority priority) {
+    var stats = bindings.flucurl_session_queue_stats(session, priority);
+    return FlucurlQueueStats(
+      started: stats.started,
+      totalWait: Duration(microseconds: stats.total_wait_us),
+      maxWait: Duration(microseconds: stats.max_wait_us),
+      pending: stats.pending,
+    );
+  }
+
+  /// Opens [count] connections to the host of [url] before they are needed,
+  /// so the next requests skip the handshakes. Each one sends a HEAD request
+  /// for [url], its result is ignored.
+  void preconnect(String url, {int count = 1}) {
+    var native = NativeFreeable();
+    bindings.flucurl_session_preconnect(session, url.toNative(native), count);
+    native.free();
+  }
+
+  /// Resolves [hosts] in the background, so their first requests don't wait
+  /// for the lookup.
+  void prefetchDns(List<String> hosts) {
+    if (hosts.isEmpty) {
+      return;
+    }
+    var native = NativeFreeable();
+    var names = native.allocate<ffi.Pointer<ffi.Char>>(
+        ffi.sizeOf<ffi.Pointer>() * hosts.length);
+    for (var i = 0; i < hosts.length; i++) {
+      names[i] = hosts[i].toNative(native);
+    }
+    bindings.flucurl_session_prefetch_dns(session, names, hosts.length);
+    native.free();
+  }
+
+  /// Registers the base url, method and headers shared by many requests,
+  /// see [FlucurlRequestTemplate.request].
+  FlucurlRequestTemplate createTemplate(
+    String baseUrl, {
+    String method = 'GET',
+    Map<String, String> headers = const {},
+  }) {
+    var base = NativeRequestTemplate(baseUrl, method, headers);
+    var handle =
+        bindings.flucurl_session_create_template(session, base.nativeTemplate.ref);
+    var templateHeaders = {
+      for (var entry in base.headers.entries) entry.key.key: entry.value
+    };
+    base.free();
+    if (handle == ffi.nullptr) {
+      throw ArgumentError.value(baseUrl, 'baseUrl', 'Invalid url');
+    }
+    return FlucurlRequestTemplate(
+      baseUrl: baseUrl,
+      method: method,
+      headers: templateHeaders,
+      handle: handle,
+    );
+  }
+
+  /// Frees [requestTemplate] once the requests using it finished. It must not
+  /// be used for new requests after that.
+  void removeTemplate(FlucurlRequestTemplate requestTemplate) {
+    bindings.flucurl_session_remove_template(session, requestTemplate.handle);
+  }
+
+  FlucurlMemoryStats memoryStats() {
+    var stats = bindings.flucurl_session_memory_stats(session);
+    return FlucurlMemoryStats(
+      outstanding: stats.outstanding,
+      cached: stats.cached,
+    );
+  }
+
+  /// Returns cached native memory to the system, e.g. after a burst of large
+  /// downloads.
+  void trimMemory() {
+    bindings.flucurl_session_trim_memory(session);
+  }
+
   void close() {
     bindings.flucurl_session_terminate(session);
+    _closeEvents();
+  }
+
+  /// Closes the client without waiting for outstanding requests first. New
+  /// requests fail right away, pending ones get [drain] to finish and are
+  /// cancelled after that. Completes once the native session is freed.
+  Future<void> shutdown({Duration drain = const Duration(seconds: 5)}) {
+    var completer = Completer<void>();
+    late ffi.NativeCallable<generated.ShutdownCallbackFunction> onShutdown;
+    onShutdown =
+        ffi.NativeCallable<generated.ShutdownCallbackFunction>.listener(() {
+      onShutdown.close();
+      _closeEvents();
+      completer.complete();
+    });
+    bindings.flucurl_session_shutdown(
+        session, drain.inMilliseconds, onShutdown.nativeFunction);
+    return completer.future;
   }
 }
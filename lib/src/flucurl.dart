@@ -4,4 +4,10 @@ abstract class Flucurl {
   static init() {
     bindings.flucurl_global_init();
   }
+
+  /// Sets how many threads serve all clients using [LoopMode.LOOP_SHARED].
+  /// Must be called before the first such client is created.
+  static setLoopPoolSize(int size) {
+    bindings.flucurl_global_set_loop_pool_size(size);
+  }
 }
\ No newline at end of file
@@ -45,7 +45,27 @@ class FlucurlBindings {
   late final _flucurl_global_deinit =
       _flucurl_global_deinitPtr.asFunction<void Function()>();
 
-  void flucurl_upload_append(
+  /// Number of threads of the loop pool used by LOOP_SHARED sessions, 1 by
+  /// default. Only has an effect before the first such session is created.
+  void flucurl_global_set_loop_pool_size(
+    int size,
+  ) {
+    return _flucurl_global_set_loop_pool_size(
+      size,
+    );
+  }
+
+  late final _flucurl_global_set_loop_pool_sizePtr =
+      _lookup<ffi.NativeFunction<ffi.Void Function(ffi.Int)>>(
+          'flucurl_global_set_loop_pool_size');
+  late final _flucurl_global_set_loop_pool_size =
+      _flucurl_global_set_loop_pool_sizePtr.asFunction<void Function(int)>();
+
+  /// Queues a chunk of the request body, it is freed with
+  /// Config::free_dart_memory once sent. Pass a copy of the state taken with
+  /// the id returned by flucurl_session_send_request: once that request
+  /// finished, the chunk is not taken and 0 is returned.
+  int flucurl_upload_append(
     UploadState arg0,
     Field arg1,
   ) {
@@ -56,10 +76,10 @@ class FlucurlBindings {
   }
 
   late final _flucurl_upload_appendPtr =
-      _lookup<ffi.NativeFunction<ffi.Void Function(UploadState, Field)>>(
+      _lookup<ffi.NativeFunction<ffi.Int Function(UploadState, Field)>>(
           'flucurl_upload_append');
   late final _flucurl_upload_append =
-      _flucurl_upload_appendPtr.asFunction<void Function(UploadState, Field)>();
+      _flucurl_upload_appendPtr.asFunction<int Function(UploadState, Field)>();
 
   void flucurl_free_reponse(
     Response arg0,
@@ -75,6 +95,28 @@ class FlucurlBindings {
   late final _flucurl_free_reponse =
       _flucurl_free_reponsePtr.asFunction<void Function(Response)>();
 
+  /// Index of the first header at or after from named name, compared case
+  /// insensitively, -1 if there is none.
+  int flucurl_response_find_header(
+    Response response,
+    ffi.Pointer<ffi.Char> name,
+    int from,
+  ) {
+    return _flucurl_response_find_header(
+      response,
+      name,
+      from,
+    );
+  }
+
+  late final _flucurl_response_find_headerPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(Response, ffi.Pointer<ffi.Char>,
+              ffi.Int)>>('flucurl_response_find_header');
+  late final _flucurl_response_find_header =
+      _flucurl_response_find_headerPtr
+          .asFunction<int Function(Response, ffi.Pointer<ffi.Char>, int)>();
+
   void flucurl_free_bodydata(
     ffi.Pointer<BodyData> arg0,
   ) {
@@ -117,12 +159,39 @@ class FlucurlBindings {
   late final _flucurl_session_terminate = _flucurl_session_terminatePtr
       .asFunction<void Function(ffi.Pointer<ffi.Void>)>();
 
+  /// Closes the session without blocking the caller. New requests fail right
+  /// away, accepted ones get drain_ms milliseconds to finish and are then
+  /// cancelled. The session is freed on a worker thread, which calls callback
+  /// once it is gone. The session must not be used after callback.
+  void flucurl_session_shutdown(
+    ffi.Pointer<ffi.Void> session,
+    int drain_ms,
+    ShutdownCallback callback,
+  ) {
+    return _flucurl_session_shutdown(
+      session,
+      drain_ms,
+      callback,
+    );
+  }
+
+  late final _flucurl_session_shutdownPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Void Function(ffi.Pointer<ffi.Void>, ffi.Int,
+              ShutdownCallback)>>('flucurl_session_shutdown');
+  late final _flucurl_session_shutdown =
+      _flucurl_session_shutdownPtr.asFunction<
+          void Function(ffi.Pointer<ffi.Void>, int, ShutdownCallback)>();
+
+  /// request_id, when not null, receives an id for
+  /// flucurl_session_cancel_request.
   ffi.Pointer<UploadState> flucurl_session_send_request(
     ffi.Pointer<ffi.Void> session,
     Request request,
     ResponseCallback callback,
     DataHandler onData,
     ErrorHandler onError,
+    ffi.Pointer<ffi.UnsignedLongLong> request_id,
   ) {
     return _flucurl_session_send_request(
       session,
@@ -130,6 +199,7 @@ class FlucurlBindings {
       callback,
       onData,
       onError,
+      request_id,
     );
   }
 
@@ -140,11 +210,201 @@ class FlucurlBindings {
               Request,
               ResponseCallback,
               DataHandler,
-              ErrorHandler)>>('flucurl_session_send_request');
+              ErrorHandler,
+              ffi.Pointer<ffi.UnsignedLongLong>)>>('flucurl_session_send_request');
   late final _flucurl_session_send_request =
       _flucurl_session_send_requestPtr.asFunction<
-          ffi.Pointer<UploadState> Function(ffi.Pointer<ffi.Void>, Request,
-              ResponseCallback, DataHandler, ErrorHandler)>();
+          ffi.Pointer<UploadState> Function(
+              ffi.Pointer<ffi.Void>,
+              Request,
+              ResponseCallback,
+              DataHandler,
+              ErrorHandler,
+              ffi.Pointer<ffi.UnsignedLongLong>)>();
+
+  /// Moves up to max_events queued events of a DELIVERY_RING session into
+  /// events and returns their number. Keep calling it while it returns
+  /// max_events. Must not be called from several threads at once.
+  /// Requests rejected by a closing session get no event, their send returns
+  /// null instead.
+  int flucurl_session_poll_events(
+    ffi.Pointer<ffi.Void> session,
+    ffi.Pointer<Event> events,
+    int max_events,
+  ) {
+    return _flucurl_session_poll_events(
+      session,
+      events,
+      max_events,
+    );
+  }
+
+  late final _flucurl_session_poll_eventsPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Int Function(ffi.Pointer<ffi.Void>, ffi.Pointer<Event>,
+              ffi.Int)>>('flucurl_session_poll_events');
+  late final _flucurl_session_poll_events =
+      _flucurl_session_poll_eventsPtr.asFunction<
+          int Function(ffi.Pointer<ffi.Void>, ffi.Pointer<Event>, int)>();
+
+  /// Aborts a queued or running request on the worker thread. The request
+  /// gets a final error callback and its handle is freed right away.
+  /// Does nothing if the request already finished.
+  void flucurl_session_cancel_request(
+    ffi.Pointer<ffi.Void> session,
+    int request_id,
+  ) {
+    return _flucurl_session_cancel_request(
+      session,
+      request_id,
+    );
+  }
+
+  late final _flucurl_session_cancel_requestPtr = _lookup<
+          ffi.NativeFunction<
+              ffi.Void Function(ffi.Pointer<ffi.Void>, ffi.UnsignedLongLong)>>(
+      'flucurl_session_cancel_request');
+  late final _flucurl_session_cancel_request =
+      _flucurl_session_cancel_requestPtr
+          .asFunction<void Function(ffi.Pointer<ffi.Void>, int)>();
+
+  QueueStats flucurl_session_queue_stats(
+    ffi.Pointer<ffi.Void> session,
+    RequestPriority priority,
+  ) {
+    return _flucurl_session_queue_stats(
+      session,
+      priority.value,
+    );
+  }
+
+  late final _flucurl_session_queue_statsPtr = _lookup<
+      ffi.NativeFunction<
+          QueueStats Function(ffi.Pointer<ffi.Void>,
+              ffi.UnsignedInt)>>('flucurl_session_queue_stats');
+  late final _flucurl_session_queue_stats = _flucurl_session_queue_statsPtr
+      .asFunction<QueueStats Function(ffi.Pointer<ffi.Void>, int)>();
+
+  MemoryStats flucurl_session_memory_stats(
+    ffi.Pointer<ffi.Void> session,
+  ) {
+    return _flucurl_session_memory_stats(
+      session,
+    );
+  }
+
+  late final _flucurl_session_memory_statsPtr = _lookup<
+          ffi.NativeFunction<MemoryStats Function(ffi.Pointer<ffi.Void>)>>(
+      'flucurl_session_memory_stats');
+  late final _flucurl_session_memory_stats = _flucurl_session_memory_statsPtr
+      .asFunction<MemoryStats Function(ffi.Pointer<ffi.Void>)>();
+
+  /// Frees the memory the session keeps for reuse and, where the allocator
+  /// supports it, returns free heap memory to the system.
+  void flucurl_session_trim_memory(
+    ffi.Pointer<ffi.Void> session,
+  ) {
+    return _flucurl_session_trim_memory(
+      session,
+    );
+  }
+
+  late final _flucurl_session_trim_memoryPtr =
+      _lookup<ffi.NativeFunction<ffi.Void Function(ffi.Pointer<ffi.Void>)>>(
+          'flucurl_session_trim_memory');
+  late final _flucurl_session_trim_memory = _flucurl_session_trim_memoryPtr
+      .asFunction<void Function(ffi.Pointer<ffi.Void>)>();
+
+  /// Opens count connections to the host of url ahead of the requests that
+  /// will use them, including the TLS handshake and HTTP/2 negotiation. Each
+  /// one sends a HEAD request for url at PRIORITY_LOW, its result is dropped.
+  /// HTTP/2 may serve all of them over one connection.
+  void flucurl_session_preconnect(
+    ffi.Pointer<ffi.Void> session,
+    ffi.Pointer<ffi.Char> url,
+    int count,
+  ) {
+    return _flucurl_session_preconnect(
+      session,
+      url,
+      count,
+    );
+  }
+
+  late final _flucurl_session_preconnectPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Void Function(ffi.Pointer<ffi.Void>, ffi.Pointer<ffi.Char>,
+              ffi.Int)>>('flucurl_session_preconnect');
+  late final _flucurl_session_preconnect =
+      _flucurl_session_preconnectPtr.asFunction<
+          void Function(ffi.Pointer<ffi.Void>, ffi.Pointer<ffi.Char>, int)>();
+
+  /// Resolves hosts on a background thread so their first requests skip the
+  /// lookup, see Config::dns_cache_timeout. Hosts resolved recently are
+  /// skipped.
+  void flucurl_session_prefetch_dns(
+    ffi.Pointer<ffi.Void> session,
+    ffi.Pointer<ffi.Pointer<ffi.Char>> hosts,
+    int host_count,
+  ) {
+    return _flucurl_session_prefetch_dns(
+      session,
+      hosts,
+      host_count,
+    );
+  }
+
+  late final _flucurl_session_prefetch_dnsPtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Void Function(ffi.Pointer<ffi.Void>,
+              ffi.Pointer<ffi.Pointer<ffi.Char>>, ffi.Int)>>(
+      'flucurl_session_prefetch_dns');
+  late final _flucurl_session_prefetch_dns =
+      _flucurl_session_prefetch_dnsPtr.asFunction<
+          void Function(ffi.Pointer<ffi.Void>,
+              ffi.Pointer<ffi.Pointer<ffi.Char>>, int)>();
+
+  /// Parses the base url and builds the header list once for all requests
+  /// made from the template, see Request::request_template. Returns null if
+  /// the base url is invalid. The template is freed with the session unless
+  /// it was removed before.
+  ffi.Pointer<ffi.Void> flucurl_session_create_template(
+    ffi.Pointer<ffi.Void> session,
+    RequestTemplate base,
+  ) {
+    return _flucurl_session_create_template(
+      session,
+      base,
+    );
+  }
+
+  late final _flucurl_session_create_templatePtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Pointer<ffi.Void> Function(ffi.Pointer<ffi.Void>,
+              RequestTemplate)>>('flucurl_session_create_template');
+  late final _flucurl_session_create_template =
+      _flucurl_session_create_templatePtr.asFunction<
+          ffi.Pointer<ffi.Void> Function(
+              ffi.Pointer<ffi.Void>, RequestTemplate)>();
+
+  /// Requests using the template keep it alive until they finish.
+  void flucurl_session_remove_template(
+    ffi.Pointer<ffi.Void> session,
+    ffi.Pointer<ffi.Void> request_template,
+  ) {
+    return _flucurl_session_remove_template(
+      session,
+      request_template,
+    );
+  }
+
+  late final _flucurl_session_remove_templatePtr = _lookup<
+      ffi.NativeFunction<
+          ffi.Void Function(ffi.Pointer<ffi.Void>,
+              ffi.Pointer<ffi.Void>)>>('flucurl_session_remove_template');
+  late final _flucurl_session_remove_template =
+      _flucurl_session_remove_templatePtr.asFunction<
+          void Function(ffi.Pointer<ffi.Void>, ffi.Pointer<ffi.Void>)>();
 }
 
 final class Field extends ffi.Struct {
@@ -154,11 +414,32 @@ final class Field extends ffi.Struct {
   external int len;
 }
 
+/// Pending requests are served strictly by priority class, hosts within a
+/// class are served fairly.
+enum RequestPriority {
+  PRIORITY_HIGH(0),
+  PRIORITY_NORMAL(1),
+  PRIORITY_LOW(2);
+
+  final int value;
+  const RequestPriority(this.value);
+
+  static RequestPriority fromValue(int value) => switch (value) {
+        0 => PRIORITY_HIGH,
+        1 => PRIORITY_NORMAL,
+        2 => PRIORITY_LOW,
+        _ => throw ArgumentError("Unknown value for RequestPriority: $value"),
+      };
+}
+
 final class Request extends ffi.Struct {
   external ffi.Pointer<ffi.Char> url;
 
   external ffi.Pointer<ffi.Char> method;
 
+  /// Bytes of the request body, sent with flucurl_upload_append. Requests
+  /// without a body skip the upload machinery, GET and HEAD use curl's
+  /// native methods.
   @ffi.Int()
   external int content_length;
 
@@ -167,9 +448,44 @@ final class Request extends ffi.Struct {
   @ffi.Int()
   external int header_count;
 
+  /// Address to connect to instead of resolving the host of url, e.g. from
+  /// a custom resolver. Null to resolve it.
   external ffi.Pointer<ffi.Char> resolved_ip;
 
   external ffi.Pointer<ffi.Void> mtx;
+
+  @ffi.UnsignedInt()
+  external int priority;
+
+  /// Total deadline in milliseconds from submission, 0 for none.
+  /// Requests still queued at the deadline are dropped without a handle.
+  @ffi.Int()
+  external int timeout_ms;
+
+  /// Deadline in milliseconds from submission for the first response byte,
+  /// 0 for none.
+  @ffi.Int()
+  external int first_byte_timeout_ms;
+
+  /// A handle of flucurl_session_create_template or null. The url is then
+  /// resolved against the template's base url, empty for the base url
+  /// itself. A null method takes the template's and headers are added to the
+  /// template's, replacing those of the same name.
+  external ffi.Pointer<ffi.Void> request_template;
+}
+
+/// What the requests of a template share, see
+/// flucurl_session_create_template.
+final class RequestTemplate extends ffi.Struct {
+  external ffi.Pointer<ffi.Char> base_url;
+
+  /// Null for GET.
+  external ffi.Pointer<ffi.Char> method;
+
+  external ffi.Pointer<ffi.Pointer<ffi.Char>> headers;
+
+  @ffi.Int()
+  external int header_count;
 }
 
 enum HTTPVersion {
@@ -190,6 +506,46 @@ enum HTTPVersion {
       };
 }
 
+/// How the session worker drives the multi handle.
+/// - LOOP_POLL: `curl_multi_perform` + `curl_multi_poll`, available everywhere.
+/// - LOOP_SOCKET_ACTION: `curl_multi_socket_action` driven by an epoll set,
+/// only ready sockets are serviced and an idle session sleeps until woken.
+/// Falls back to LOOP_POLL on platforms without epoll.
+/// - LOOP_SHARED: like LOOP_SOCKET_ACTION, but driven by the process wide
+/// loop pool together with other sessions instead of a thread per worker.
+/// See flucurl_global_set_loop_pool_size.
+enum LoopMode {
+  LOOP_POLL(0),
+  LOOP_SOCKET_ACTION(1),
+  LOOP_SHARED(2);
+
+  final int value;
+  const LoopMode(this.value);
+
+  static LoopMode fromValue(int value) => switch (value) {
+        0 => LOOP_POLL,
+        1 => LOOP_SOCKET_ACTION,
+        2 => LOOP_SHARED,
+        _ => throw ArgumentError("Unknown value for LoopMode: $value"),
+      };
+}
+
+/// A response header, "name: value" with the value trimmed. Name and value
+/// are offsets into Response::header_data and not null terminated.
+final class Header extends ffi.Struct {
+  @ffi.Int()
+  external int name;
+
+  @ffi.Int()
+  external int name_len;
+
+  @ffi.Int()
+  external int value;
+
+  @ffi.Int()
+  external int value_len;
+}
+
 final class Response extends ffi.Struct {
   @ffi.UnsignedInt()
   external int http_version;
@@ -197,15 +553,27 @@ final class Response extends ffi.Struct {
   @ffi.Int()
   external int status;
 
-  external ffi.Pointer<Field> headers;
+  /// The headers of the final response in the order received, followed by
+  /// the header_data they point into, in one block freed by
+  /// flucurl_free_reponse.
+  external ffi.Pointer<Header> headers;
 
   @ffi.Int()
   external int header_count;
 
-  external ffi.Pointer<ffi.Void> session;
+  external ffi.Pointer<ffi.Char> header_data;
+
+  @ffi.Int()
+  external int header_data_len;
+
+  /// The response memory of the session the block came from, for
+  /// flucurl_free_reponse. It stays valid after the session is freed and is
+  /// not a session.
+  external ffi.Pointer<ffi.Void> memory;
 }
 
 final class TLSConfig extends ffi.Struct {
+  /// Apply this config, 0 for curl's defaults.
   @ffi.Int()
   external int enable;
 
@@ -214,6 +582,7 @@ final class TLSConfig extends ffi.Struct {
   external int verify_certificates;
 
   /// Enable TLS Server Name Indication (SNI).
+  /// Not applied, curl always sends it for host names.
   @ffi.Int()
   external int enable_sni;
 
@@ -222,12 +591,42 @@ final class TLSConfig extends ffi.Struct {
   /// certificate chain.
   /// The Rust API currently doesn't support trusting a single leaf certificate.
   /// Hint: PEM format starts with `-----BEGIN CERTIFICATE-----`.
+  /// They replace the system store and are parsed once per session.
   external ffi.Pointer<ffi.Pointer<ffi.Char>> trusted_root_certificates;
 
   @ffi.Int()
   external int trusted_root_certificates_length;
 }
 
+/// How results reach the caller.
+/// - DELIVERY_CALLBACK: the callbacks passed to flucurl_session_send_request
+/// are called from the worker thread for every event.
+/// - DELIVERY_RING: workers queue events and call Config::event_notify once
+/// per batch, the caller drains them with flucurl_session_poll_events.
+/// - DELIVERY_PORT: workers post every event to the Dart port
+/// Config::event_port as a list [request id, EventType, payload...]:
+/// - EVENT_RESPONSE: status, HTTPVersion, then two Uint8List: the Header
+/// table in native byte order (4 int32 per header) and the header_data
+/// its offsets point into, as in Response.
+/// - EVENT_DATA: the chunk as external Uint8List, or null once the body is
+/// complete. The chunk is freed by its finalizer.
+/// - EVENT_ERROR: the message.
+enum DeliveryMode {
+  DELIVERY_CALLBACK(0),
+  DELIVERY_RING(1),
+  DELIVERY_PORT(2);
+
+  final int value;
+  const DeliveryMode(this.value);
+
+  static DeliveryMode fromValue(int value) => switch (value) {
+        0 => DELIVERY_CALLBACK,
+        1 => DELIVERY_RING,
+        2 => DELIVERY_PORT,
+        _ => throw ArgumentError("Unknown value for DeliveryMode: $value"),
+      };
+}
+
 final class Config extends ffi.Struct {
   /// Timeout in seconds.
   @ffi.Int()
@@ -254,8 +653,108 @@ final class Config extends ffi.Struct {
   external ffi
       .Pointer<ffi.NativeFunction<ffi.Void Function(ffi.Pointer<ffi.Void>)>>
       free_dart_memory;
+
+  @ffi.UnsignedInt()
+  external int loop_mode;
+
+  /// Number of worker shards, each with its own thread and multi handle.
+  /// Requests are routed to a shard by host. 0 or 1 for a single worker,
+  /// at most max_handles, which is split between the shards.
+  @ffi.Int()
+  external int worker_count;
+
+  /// Maximum number of concurrent transfers, 0 for the default of 50.
+  /// The connection cache is sized to match.
+  @ffi.Int()
+  external int max_handles;
+
+  /// Maximum number of concurrent transfers per host, 0 for no limit.
+  @ffi.Int()
+  external int max_handles_per_host;
+
+  /// Idle easy handles kept even when they time out.
+  @ffi.Int()
+  external int min_idle_handles;
+
+  /// Seconds after which an idle easy handle beyond min_idle_handles is
+  /// freed, 0 for the default of 30.
+  @ffi.Int()
+  external int handle_idle_timeout;
+
+  /// Let every host find its own concurrency limit from time to first byte
+  /// and error rate (AIMD). Requests over the limit stay queued.
+  @ffi.Int()
+  external int adaptive_concurrency;
+
+  /// Bounds of the adaptive limit per host. 0 for 1 and max_handles.
+  @ffi.Int()
+  external int adaptive_min_limit;
+
+  @ffi.Int()
+  external int adaptive_max_limit;
+
+  /// Seconds without requests after which a worker thread exits, 0 to keep
+  /// it. Workers start on the first request and restart on the next one,
+  /// connections are kept in between.
+  @ffi.Int()
+  external int worker_idle_timeout;
+
+  /// Response body bytes collected before onData is called, 0 to call it
+  /// for every chunk curl receives. Larger chunks mean fewer callbacks.
+  @ffi.Int()
+  external int body_coalesce_bytes;
+
+  /// Milliseconds a partial chunk is held back at most, 0 for 5.
+  @ffi.Int()
+  external int body_coalesce_delay_ms;
+
+  @ffi.UnsignedInt()
+  external int delivery_mode;
+
+  /// DELIVERY_RING only, called from a worker thread when events are ready.
+  /// It is not called again until flucurl_session_poll_events was called.
+  external EventNotifyCallback event_notify;
+
+  /// DELIVERY_PORT only, the native port of a Dart ReceivePort and Dart's
+  /// NativeApi.postCObject.
+  @ffi.LongLong()
+  external int event_port;
+
+  external ffi.Pointer<ffi.Void> post_cobject;
+
+  /// Bytes of freed response memory kept for reuse, 0 for the default of
+  /// 4 MB. Memory beyond it goes back to the system.
+  @ffi.Int()
+  external int memory_cache_limit;
+
+  /// Seconds resolved addresses are kept, 0 for the default of 60.
+  @ffi.Int()
+  external int dns_cache_timeout;
+
+  /// Seconds a host that failed to resolve fails further requests right
+  /// away, 0 for the default of 5, negative to always try again.
+  @ffi.Int()
+  external int dns_negative_timeout;
+
+  /// Share DNS entries and TLS sessions with every other session that sets
+  /// it, instead of only within this session. Connections are never shared,
+  /// curl does not support one connection cache used by several threads.
+  @ffi.Int()
+  external int global_share;
+
+  /// Directory the Alt-Svc and HSTS caches are loaded from at start and
+  /// saved to, in curl's file formats, so HTTP/3 upgrades and HSTS survive
+  /// a restart. Created if missing, null to keep them in memory only.
+  external ffi.Pointer<ffi.Char> state_dir;
+
+  /// Seconds between saves of the state while requests run, 0 for 60.
+  @ffi.Int()
+  external int state_flush_interval;
 }
 
+/// A chunk of a response body. It points into a receive buffer shared with
+/// the other chunks of the request, which is freed once
+/// flucurl_free_bodydata was called for all of them.
 final class BodyData extends ffi.Struct {
   external ffi.Pointer<ffi.Char> data;
 
@@ -263,8 +762,46 @@ final class BodyData extends ffi.Struct {
   external int size;
 
   external ffi.Pointer<ffi.Void> session;
+
+  external ffi.Pointer<ffi.Void> slab;
 }
 
+enum EventType {
+  EVENT_RESPONSE(0),
+  EVENT_DATA(1),
+  EVENT_ERROR(2);
+
+  final int value;
+  const EventType(this.value);
+
+  static EventType fromValue(int value) => switch (value) {
+        0 => EVENT_RESPONSE,
+        1 => EVENT_DATA,
+        2 => EVENT_ERROR,
+        _ => throw ArgumentError("Unknown value for EventType: $value"),
+      };
+}
+
+/// A response, body chunk or error of a DELIVERY_RING session, carrying what
+/// the corresponding callback would get.
+final class Event extends ffi.Struct {
+  @ffi.UnsignedInt()
+  external int type;
+
+  @ffi.UnsignedLongLong()
+  external int request_id;
+
+  /// EVENT_RESPONSE, to be freed with flucurl_free_reponse.
+  external Response response;
+
+  /// EVENT_DATA, null once the body is complete.
+  external ffi.Pointer<BodyData> data;
+
+  /// EVENT_ERROR, has static storage duration.
+  external ffi.Pointer<ffi.Char> message;
+}
+
+/// The request body of a running request, see flucurl_upload_append.
 final class UploadState extends ffi.Struct {
   external ffi.Pointer<ffi.Void> session;
 
@@ -279,8 +816,46 @@ final class UploadState extends ffi.Struct {
 
   @ffi.UnsignedLongLong()
   external int cur;
+
+  /// The id of the request the state belongs to right now, 0 once it
+  /// finished.
+  @ffi.UnsignedLongLong()
+  external int request_id;
+}
+
+/// Queue wait of requests of one priority class, summed over all workers.
+final class QueueStats extends ffi.Struct {
+  /// Requests that left the queue and started.
+  @ffi.UnsignedLongLong()
+  external int started;
+
+  /// Total and maximum time started requests spent queued, in microseconds.
+  @ffi.UnsignedLongLong()
+  external int total_wait_us;
+
+  @ffi.UnsignedLongLong()
+  external int max_wait_us;
+
+  /// Requests waiting for a handle right now.
+  @ffi.Int()
+  external int pending;
+}
+
+/// Response memory of a session.
+final class MemoryStats extends ffi.Struct {
+  /// Bytes of headers and body chunks not freed yet.
+  @ffi.UnsignedLongLong()
+  external int outstanding;
+
+  /// Bytes kept for reuse, see Config::memory_cache_limit.
+  @ffi.UnsignedLongLong()
+  external int cached;
 }
 
+typedef EventNotifyCallback
+    = ffi.Pointer<ffi.NativeFunction<EventNotifyCallbackFunction>>;
+typedef EventNotifyCallbackFunction = ffi.Void Function();
+typedef DartEventNotifyCallbackFunction = void Function();
 typedef ResponseCallback
     = ffi.Pointer<ffi.NativeFunction<ResponseCallbackFunction>>;
 typedef ResponseCallbackFunction = ffi.Void Function(Response);
@@ -291,3 +866,7 @@ typedef DartDataHandlerFunction = void Function(ffi.Pointer<BodyData>);
 typedef ErrorHandler = ffi.Pointer<ffi.NativeFunction<ErrorHandlerFunction>>;
 typedef ErrorHandlerFunction = ffi.Void Function(ffi.Pointer<ffi.Char> message);
 typedef DartErrorHandlerFunction = void Function(ffi.Pointer<ffi.Char> message);
+typedef ShutdownCallback
+    = ffi.Pointer<ffi.NativeFunction<ShutdownCallbackFunction>>;
+typedef ShutdownCallbackFunction = ffi.Void Function();
+typedef DartShutdownCallbackFunction = void Function();
@@ -14,15 +14,43 @@ class NativeConfig with NativeFreeable {
     nativeConfig.ref.timeout = config.timeout;
     nativeConfig.ref.proxy = config.proxy == '' ? ffi.nullptr.cast() : config.proxy.toNative(this);
     nativeConfig.ref.tls_config = allocate(ffi.sizeOf<bindings.TLSConfig>());
+    nativeConfig.ref.tls_config.ref.enable = 1;
     nativeConfig.ref.tls_config.ref.enable_sni = config.tlsConfig.sni ? 1 : 0;
     nativeConfig.ref.tls_config.ref.verify_certificates = config.tlsConfig.verifyCertificates ? 1 : 0;
     var cas = allocate<ffi.Pointer<ffi.Char>>(ffi.sizeOf<ffi.Pointer>() * config.tlsConfig.trustedRootCertificates.length);
     for (int i = 0; i < config.tlsConfig.trustedRootCertificates.length; i++) {
       cas[i] = config.tlsConfig.trustedRootCertificates[i].toNative(this);
     }
+    nativeConfig.ref.tls_config.ref.trusted_root_certificates = cas;
+    nativeConfig.ref.tls_config.ref.trusted_root_certificates_length =
+        config.tlsConfig.trustedRootCertificates.length;
     nativeConfig.ref.idle_timeout = config.idleTimeout;
     nativeConfig.ref.keep_alive = config.keepAlive ? 1 : 0;
     nativeConfig.ref.http_version = config.httpVersion.index;
+    nativeConfig.ref.loop_mode = config.loopMode.value;
+    nativeConfig.ref.worker_count = config.workerCount;
+    nativeConfig.ref.max_handles = config.maxConnections;
+    nativeConfig.ref.max_handles_per_host = config.maxConnectionsPerHost;
+    nativeConfig.ref.min_idle_handles = config.minIdleHandles;
+    nativeConfig.ref.handle_idle_timeout = config.handleIdleTimeout;
+    nativeConfig.ref.adaptive_concurrency = config.adaptiveConcurrency ? 1 : 0;
+    nativeConfig.ref.adaptive_min_limit = 0;
+    nativeConfig.ref.adaptive_max_limit = 0;
+    nativeConfig.ref.worker_idle_timeout = config.workerIdleTimeout;
+    nativeConfig.ref.body_coalesce_bytes = config.bodyCoalesceBytes;
+    nativeConfig.ref.body_coalesce_delay_ms =
+        config.bodyCoalesceDelay.inMilliseconds;
+    nativeConfig.ref.delivery_mode = config.deliveryMode.value;
+    // set by the client for DELIVERY_RING and DELIVERY_PORT
+    nativeConfig.ref.event_notify = ffi.nullptr;
+    nativeConfig.ref.event_port = 0;
+    nativeConfig.ref.post_cobject = ffi.nullptr;
+    nativeConfig.ref.memory_cache_limit = config.memoryCacheLimit;
+    nativeConfig.ref.dns_cache_timeout = config.dnsCacheTimeout;
+    nativeConfig.ref.dns_negative_timeout = config.dnsNegativeTimeout;
+    nativeConfig.ref.global_share = config.globalShare ? 1 : 0;
+    nativeConfig.ref.state_dir = config.stateDir == null ? ffi.nullptr.cast() : config.stateDir!.toNative(this);
+    nativeConfig.ref.state_flush_interval = config.stateFlushInterval;
     _freeDartMemory ??= ffi.NativeCallable.listener(NativeFreeable.freePtr);
     nativeConfig.ref.free_dart_memory = _freeDartMemory!.nativeFunction;
   }
@@ -49,6 +77,12 @@ class NativeRequest with NativeFreeable {
     nativeRequest.ref.content_length = contentSize;
     nativeRequest.ref.header_count = headers.length;
     nativeRequest.ref.resolved_ip = resolvedIP == null ? ffi.nullptr.cast() : resolvedIP.toNative(this);
+    nativeRequest.ref.priority = request.priority.value;
+    nativeRequest.ref.timeout_ms = request.timeout?.inMilliseconds ?? 0;
+    nativeRequest.ref.first_byte_timeout_ms =
+        request.firstByteTimeout?.inMilliseconds ?? 0;
+    nativeRequest.ref.request_template =
+        request.requestTemplate?.handle ?? ffi.nullptr;
   }
 
   void getHeaders(Map<String, String> reqHeaders) {
@@ -56,7 +90,10 @@ class NativeRequest with NativeFreeable {
       // prevent duplicate headers
       headers[HeaderKey(key)] ??= reqHeaders[key]!;
     }
-    headers[HeaderKey('User-Agent')] ??= "Dart with Flucurl";
+    // the template has it already
+    if (request.requestTemplate == null) {
+      headers[HeaderKey('User-Agent')] ??= "Dart with Flucurl";
+    }
   }
 
   int get contentSize {
@@ -68,6 +105,32 @@ class NativeRequest with NativeFreeable {
   }
 }
 
+class NativeRequestTemplate with NativeFreeable {
+  late final ffi.Pointer<bindings.RequestTemplate> nativeTemplate;
+
+  final Map<HeaderKey, String> headers = {};
+
+  NativeRequestTemplate(String baseUrl, String method,
+      Map<String, String> templateHeaders) {
+    for (var key in templateHeaders.keys) {
+      // prevent duplicate headers
+      headers[HeaderKey(key)] ??= templateHeaders[key]!;
+    }
+    headers[HeaderKey('User-Agent')] ??= "Dart with Flucurl";
+    nativeTemplate = allocate(ffi.sizeOf<bindings.RequestTemplate>());
+    nativeTemplate.ref.base_url = baseUrl.toNative(this);
+    nativeTemplate.ref.method = method.toNative(this);
+    nativeTemplate.ref.headers =
+        allocate(ffi.sizeOf<ffi.Pointer>() * headers.length);
+    int i = 0;
+    for (var entry in headers.entries) {
+      nativeTemplate.ref.headers[i] = "${entry.key}: ${entry.value}".toNative(this);
+      i++;
+    }
+    nativeTemplate.ref.header_count = headers.length;
+  }
+}
+
 class HeaderKey {
   final String key;
   
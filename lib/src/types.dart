@@ -1,7 +1,11 @@
+import 'dart:ffi' as ffi;
 import 'dart:typed_data';
 import 'flucurl_bindings_generated.dart' as generated;
 
 typedef HttpVersion = generated.HTTPVersion;
+typedef LoopMode = generated.LoopMode;
+typedef RequestPriority = generated.RequestPriority;
+typedef DeliveryMode = generated.DeliveryMode;
 
 class FlucurlConfig {
   final int timeout;
@@ -18,6 +22,76 @@ class FlucurlConfig {
 
   final int idleTimeout;
 
+  /// How the native worker waits for network activity.
+  /// [LoopMode.LOOP_SOCKET_ACTION] only wakes up for ready sockets and keeps
+  /// idle sessions asleep, it falls back to polling where epoll is missing.
+  /// [LoopMode.LOOP_SHARED] does the same on threads shared by all clients,
+  /// see `Flucurl.setLoopPoolSize`.
+  final LoopMode loopMode;
+
+  /// Number of native worker threads. Requests to the same host always run
+  /// on the same worker so connections keep being reused.
+  final int workerCount;
+
+  /// Maximum number of concurrent requests, further requests are queued.
+  final int maxConnections;
+
+  /// Maximum number of concurrent requests to one host, 0 for no limit.
+  final int maxConnectionsPerHost;
+
+  /// Idle native handles that are always kept for the next burst.
+  final int minIdleHandles;
+
+  /// Seconds after which idle native handles above [minIdleHandles] are freed.
+  final int handleIdleTimeout;
+
+  /// Adjust the concurrency limit of every host from observed latency and
+  /// errors, so a degraded backend gets fewer requests instead of longer
+  /// queues. [maxConnectionsPerHost] still caps the limit.
+  final bool adaptiveConcurrency;
+
+  /// Seconds without requests after which native worker threads exit, 0 to
+  /// keep them. They start again with the next request.
+  final int workerIdleTimeout;
+
+  /// Response body bytes collected natively before they are passed to Dart
+  /// as one chunk, 0 to pass every chunk as it arrives. Off by default, as
+  /// chunks may be held back for up to [bodyCoalesceDelay].
+  final int bodyCoalesceBytes;
+
+  /// How long a partial chunk is held back at most.
+  final Duration bodyCoalesceDelay;
+
+  /// How responses reach Dart. [DeliveryMode.DELIVERY_RING] batches the
+  /// events of all requests into one wakeup of the isolate instead of a
+  /// native callback per event, which pays off at high request rates.
+  /// [DeliveryMode.DELIVERY_PORT] posts every event to a port of the isolate
+  /// and hands body chunks over without a copy or a callback trampoline.
+  final DeliveryMode deliveryMode;
+
+  /// Bytes of freed response memory kept for reuse, the rest is returned to
+  /// the system. See [FlucurlClient.trimMemory].
+  final int memoryCacheLimit;
+
+  /// Seconds resolved addresses are reused, see [FlucurlClient.prefetchDns].
+  final int dnsCacheTimeout;
+
+  /// Seconds a host that failed to resolve fails further requests right
+  /// away, negative to always try again.
+  final int dnsNegativeTimeout;
+
+  /// Share DNS entries and TLS sessions with the other clients that set it,
+  /// so they skip lookups and resume TLS sessions to hosts one of them
+  /// talked to. Each client keeps its own connections.
+  final bool globalShare;
+
+  /// Directory to keep Alt-Svc and HSTS knowledge in across restarts, e.g.
+  /// below the app's support directory. Null to start cold every time.
+  final String? stateDir;
+
+  /// Seconds between saves of the state while requests run.
+  final int stateFlushInterval;
+
   const FlucurlConfig({
     this.timeout = 30,
     this.proxy = '',
@@ -26,14 +100,34 @@ class FlucurlConfig {
     this.httpVersion = HttpVersion.HTTP2,
     this.keepAlive = true,
     this.idleTimeout = 120,
+    this.loopMode = LoopMode.LOOP_POLL,
+    this.workerCount = 1,
+    this.maxConnections = 50,
+    this.maxConnectionsPerHost = 0,
+    this.minIdleHandles = 0,
+    this.handleIdleTimeout = 30,
+    this.adaptiveConcurrency = false,
+    this.workerIdleTimeout = 0,
+    this.bodyCoalesceBytes = 0,
+    this.bodyCoalesceDelay = const Duration(milliseconds: 5),
+    this.deliveryMode = DeliveryMode.DELIVERY_CALLBACK,
+    this.memoryCacheLimit = 4 * 1024 * 1024,
+    this.dnsCacheTimeout = 60,
+    this.dnsNegativeTimeout = 5,
+    this.globalShare = false,
+    this.stateDir,
+    this.stateFlushInterval = 60,
   });
 }
 
 class TlsConfig {
   final bool verifyCertificates;
 
+  /// Has no effect, SNI is always sent for host names.
   final bool sni;
 
+  /// PEM root certificates trusted instead of the system store, parsed once
+  /// per client.
   final List<String> trustedRootCertificates;
 
   const TlsConfig({
@@ -52,24 +146,103 @@ class FlucurlRequest {
 
   final Object? body;
 
+  /// Requests waiting for a connection are started by priority first.
+  final RequestPriority priority;
+
+  /// Fails the request if it is not complete this long after submission,
+  /// including time spent waiting for a connection.
+  final Duration? timeout;
+
+  /// Fails the request if no response byte arrived this long after
+  /// submission.
+  final Duration? firstByteTimeout;
+
+  /// [url] is resolved against the base url of the template and [headers]
+  /// are sent in addition to its headers, see [FlucurlRequestTemplate].
+  final FlucurlRequestTemplate? requestTemplate;
+
   FlucurlRequest({
     required this.url,
     this.method = 'GET',
     Map<String, String>? headers,
     this.body,
+    this.priority = RequestPriority.PRIORITY_NORMAL,
+    this.timeout,
+    this.firstByteTimeout,
+    this.requestTemplate,
   }): headers = headers ?? {};
 
+  /// The absolute url, [url] resolved against [requestTemplate].
+  String get fullUrl => requestTemplate?.resolve(url) ?? url;
+
   FlucurlRequest copyWith({
     String? url,
     String? method,
     Map<String, String>? headers,
     Object? body,
+    RequestPriority? priority,
+    Duration? timeout,
+    Duration? firstByteTimeout,
+    FlucurlRequestTemplate? requestTemplate,
   }) {
     return FlucurlRequest(
       url: url ?? this.url,
       method: method ?? this.method,
       headers: headers ?? this.headers,
       body: body ?? this.body,
+      priority: priority ?? this.priority,
+      timeout: timeout ?? this.timeout,
+      firstByteTimeout: firstByteTimeout ?? this.firstByteTimeout,
+      requestTemplate: requestTemplate ?? this.requestTemplate,
+    );
+  }
+}
+
+/// Base url, method and headers shared by many requests, created with
+/// `FlucurlClient.createTemplate`. The url is parsed and the header list is
+/// built natively once instead of for every request.
+class FlucurlRequestTemplate {
+  final String baseUrl;
+
+  final String method;
+
+  final Map<String, String> headers;
+
+  /// The native template, valid until it is removed or the client closed.
+  final ffi.Pointer<ffi.Void> handle;
+
+  late final Uri _base = Uri.parse(baseUrl);
+
+  FlucurlRequestTemplate({
+    required this.baseUrl,
+    required this.method,
+    required this.headers,
+    required this.handle,
+  });
+
+  String resolve(String path) =>
+      path.isEmpty ? baseUrl : _base.resolve(path).toString();
+
+  /// A request for [path] relative to [baseUrl]. [headers] replace the
+  /// template's headers of the same name.
+  FlucurlRequest request(
+    String path, {
+    String? method,
+    Map<String, String>? headers,
+    Object? body,
+    RequestPriority priority = RequestPriority.PRIORITY_NORMAL,
+    Duration? timeout,
+    Duration? firstByteTimeout,
+  }) {
+    return FlucurlRequest(
+      url: path,
+      method: method ?? this.method,
+      headers: headers,
+      body: body,
+      priority: priority,
+      timeout: timeout,
+      firstByteTimeout: firstByteTimeout,
+      requestTemplate: this,
     );
   }
 }
@@ -92,4 +265,48 @@ class FlucurlResponse {
     required this.headers,
     required this.body,
   });
-}
\ No newline at end of file
+
+  /// Values of the header [name], matched case insensitively.
+  List<String> header(String name) {
+    name = name.toLowerCase();
+    return [
+      for (var entry in headers.entries)
+        if (entry.key.toLowerCase() == name) ...entry.value
+    ];
+  }
+}
+
+/// How long requests of one priority waited for a connection.
+class FlucurlQueueStats {
+  final int started;
+
+  final Duration totalWait;
+
+  final Duration maxWait;
+
+  final int pending;
+
+  const FlucurlQueueStats({
+    required this.started,
+    required this.totalWait,
+    required this.maxWait,
+    required this.pending,
+  });
+
+  Duration get averageWait =>
+      started == 0 ? Duration.zero : totalWait ~/ started;
+}
+
+/// Native memory of response headers and bodies.
+class FlucurlMemoryStats {
+  /// Bytes not freed yet, body chunks are freed once garbage collected.
+  final int outstanding;
+
+  /// Bytes kept for reuse.
+  final int cached;
+
+  const FlucurlMemoryStats({
+    required this.outstanding,
+    required this.cached,
+  });
+}
@@ -6,240 +6,3346 @@
 #include <curl/urlapi.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <memory_resource>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <random>
-#include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#define FLUCURL_USE_EPOLL 1
+#endif
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <sys/socket.h>
+#endif
+
+// defined by the build when it links OpenSSL, see CMakeLists.txt
+#ifdef FLUCURL_USE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+
 class Session;
+class Shard;
+class EventLoop;
+struct TemplateData;
+#ifdef FLUCURL_USE_OPENSSL
+class TrustedRoots;
+#endif
 using namespace std::chrono;
+// Response memory of one session: header blocks come from a pool, receive
+// slabs from free lists per size class. Freed memory is kept for reuse up to
+// Config::memory_cache_limit, the rest goes back to the system. Every block
+// handed out holds a reference, so the manager outlives its session until
+// the last response and chunk are freed.
 class MemoryManager {
-  std::pmr::synchronized_pool_resource pool;
-  std::pmr::polymorphic_allocator<char> resource;
+  // counts what the header pool holds
+  class CountingResource : public std::pmr::memory_resource {
+    void *do_allocate(size_t bytes, size_t alignment) override {
+      held += bytes;
+      return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+      held -= bytes;
+      std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const memory_resource &other) const noexcept override {
+      return this == &other;
+    }
+
+   public:
+    size_t held = 0;
+  };
+
+  static constexpr int slab_classes = 7;
+
+  std::atomic<int> refs = 1;
+  size_t cache_limit;
+
+  std::mutex header_mutex;
+  CountingResource header_upstream;
+  // larger blocks bypass the pools and are returned right away
+  std::pmr::unsynchronized_pool_resource header_pool{
+      {.max_blocks_per_chunk = 64, .largest_required_pool_block = 4096},
+      &header_upstream};
+  size_t header_outstanding = 0;
+
+  std::mutex slab_mutex;
+  // slabs of slab_min_size << i bytes
+  std::vector<void *> free_slabs[slab_classes];
+  size_t slab_outstanding = 0;
+  size_t slab_cached = 0;
+
+  ~MemoryManager() {
+    for (auto &slabs : free_slabs) {
+      for (auto *slab : slabs) {
+        ::operator delete(slab);
+      }
+    }
+  }
+
+  // the free list for slabs of size bytes, -1 if they are not cached
+  static int slab_class(size_t size) {
+    for (int i = 0; i < slab_classes; i++) {
+      if (size == slab_min_size << i) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+ public:
+  static constexpr size_t slab_min_size = 16 * 1024;
+  static constexpr size_t slab_max_size = slab_min_size
+                                          << (slab_classes - 1);
+
+  explicit MemoryManager(size_t cache_limit) : cache_limit(cache_limit) {}
+
+  void retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+
+  void release() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  // safe to call from any thread
+  void *allocate_header(size_t size, size_t alignment) {
+    retain();
+    std::lock_guard lock(header_mutex);
+    header_outstanding += size;
+    return header_pool.allocate(size, alignment);
+  }
+
+  // safe to call from any thread
+  void deallocate_header(void *p, size_t size, size_t alignment) {
+    {
+      std::lock_guard lock(header_mutex);
+      header_pool.deallocate(p, size, alignment);
+      header_outstanding -= size;
+      if (header_outstanding == 0 && header_upstream.held > cache_limit) {
+        // only possible once nothing is in use
+        header_pool.release();
+      }
+    }
+    release();
+  }
+
+  // the size a slab of at least size bytes gets
+  static size_t slab_size(size_t size) {
+    if (size > slab_max_size) {
+      return size;
+    }
+    size_t rounded = slab_min_size;
+    while (rounded < size) {
+      rounded <<= 1;
+    }
+    return rounded;
+  }
+
+  // safe to call from any thread, size as returned by slab_size
+  void *allocate_slab(size_t size) {
+    retain();
+    int index = slab_class(size);
+    {
+      std::lock_guard lock(slab_mutex);
+      slab_outstanding += size;
+      if (index >= 0 && !free_slabs[index].empty()) {
+        void *slab = free_slabs[index].back();
+        free_slabs[index].pop_back();
+        slab_cached -= size;
+        return slab;
+      }
+    }
+    return ::operator new(size);
+  }
+
+  // safe to call from any thread
+  void deallocate_slab(void *slab, size_t size) {
+    int index = slab_class(size);
+    {
+      std::lock_guard lock(slab_mutex);
+      slab_outstanding -= size;
+      if (index >= 0 && slab_cached + size <= cache_limit) {
+        free_slabs[index].push_back(slab);
+        slab_cached += size;
+        slab = nullptr;
+      }
+    }
+    ::operator delete(slab);
+    release();
+  }
+
+  // safe to call from any thread
+  MemoryStats stats() {
+    MemoryStats stats{};
+    {
+      std::lock_guard lock(header_mutex);
+      stats.outstanding += header_outstanding;
+      stats.cached += header_upstream.held - header_outstanding;
+    }
+    std::lock_guard lock(slab_mutex);
+    stats.outstanding += slab_outstanding;
+    stats.cached += slab_cached;
+    return stats;
+  }
+
+  // safe to call from any thread
+  void trim() {
+    {
+      std::lock_guard lock(header_mutex);
+      if (header_outstanding == 0) {
+        header_pool.release();
+      }
+    }
+    std::vector<void *> slabs;
+    {
+      std::lock_guard lock(slab_mutex);
+      for (auto &list : free_slabs) {
+        slabs.insert(slabs.end(), list.begin(), list.end());
+        list.clear();
+      }
+      slab_cached = 0;
+    }
+    for (auto *slab : slabs) {
+      ::operator delete(slab);
+    }
+#if defined(__GLIBC__)
+    // freed memory stays with malloc otherwise
+    malloc_trim(0);
+#endif
+  }
+};
+
+// Receive buffer of one request. Body chunks are appended to it together
+// with the BodyData describing them, so delivering a chunk allocates
+// nothing. Every BodyData holds a reference, as does the request while it
+// appends, and the slab is freed with the last one.
+class Slab {
+  std::atomic<int> refs = 1;
+  MemoryManager *memory;
+  size_t capacity;
+  size_t used = 0;
+
+  Slab(MemoryManager *memory, size_t size)
+      : memory(memory), capacity(size - sizeof(Slab)) {}
+  char *base() { return reinterpret_cast<char *>(this + 1); }
 
  public:
-  MemoryManager() : resource(&pool) {}
-  void *allocate(size_t size) { return resource.allocate(size); }
-  void deallocate(void *p, size_t size) {
-    resource.deallocate(static_cast<char *>(p), size);
+  // the first slab of a request is small, later ones grow up to max_size
+  static constexpr size_t min_size = MemoryManager::slab_min_size;
+  static constexpr size_t max_size = MemoryManager::slab_max_size;
+
+  // size includes the slab itself and is rounded up to a slab size class
+  static Slab *create(MemoryManager *memory, size_t size) {
+    size = MemoryManager::slab_size(size);
+    return new (memory->allocate_slab(size)) Slab(memory, size);
+  }
+
+  size_t size() const { return sizeof(Slab) + capacity; }
+
+  // grows the last chunk of the slab in place, false if it is not the last
+  // one or the data does not fit
+  bool extend(BodyData *body_data, const char *data, size_t size) {
+    if (body_data->data + body_data->size != base() + used ||
+        used + size > capacity) {
+      return false;
+    }
+    std::memcpy(base() + used, data, size);
+    used += size;
+    body_data->size += static_cast<int>(size);
+    return true;
+  }
+
+  // nullptr if the chunk does not fit
+  BodyData *append(const char *data, size_t size, void *session) {
+    size_t offset = (used + alignof(BodyData) - 1) & ~(alignof(BodyData) - 1);
+    if (offset + sizeof(BodyData) + size > capacity) {
+      return nullptr;
+    }
+    auto *body_data = new (base() + offset) BodyData();
+    body_data->data = base() + offset + sizeof(BodyData);
+    body_data->size = static_cast<int>(size);
+    body_data->session = session;
+    body_data->slab = this;
+    std::memcpy(body_data->data, data, size);
+    used = offset + sizeof(BodyData) + size;
+    refs.fetch_add(1, std::memory_order_relaxed);
+    return body_data;
+  }
+
+  // safe to call from any thread
+  void release() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      auto *owner = memory;
+      auto bytes = size();
+      this->~Slab();
+      owner->deallocate_slab(this, bytes);
+    }
   }
 };
 
-MemoryManager header_manager, body_manager;
+// appends a body chunk to the request's current slab, starting a larger one
+// with room for at least min_capacity when it is full
+BodyData *slab_append(Slab *&slab, MemoryManager *memory, const char *data,
+                      size_t size, void *session, size_t min_capacity = 0) {
+  if (slab) {
+    if (auto *body_data = slab->append(data, size, session)) {
+      return body_data;
+    }
+  }
+  size_t capacity = slab ? std::min(slab->size() * 2, Slab::max_size)
+                         : Slab::min_size;
+  capacity = std::max(
+      {capacity, std::min(sizeof(Slab) + min_capacity, Slab::max_size),
+       sizeof(Slab) + size + sizeof(BodyData) + alignof(BodyData)});
+  if (slab) {
+    slab->release();
+  }
+  slab = Slab::create(memory, capacity);
+  return slab->append(data, size, session);
+}
+
+// Hierarchical timer wheel with 1 ms ticks. 4 levels of 64 slots cover
+// about 4.6 hours, timers further out wait in the last level and cascade
+// down as time passes. Scheduling and cancelling are O(1), nodes are
+// intrusive so timers never allocate. Not thread safe.
+class TimerWheel {
+ public:
+  struct Node {
+    Node *prev = nullptr;
+    Node *next = nullptr;
+    uint64_t expires = 0;
+    void *data = nullptr;
+
+    bool linked() const { return prev != nullptr; }
+  };
+
+ private:
+  static constexpr int levels = 4;
+  static constexpr int slot_bits = 6;
+  static constexpr int slots = 1 << slot_bits;
+  static constexpr uint64_t slot_mask = slots - 1;
+  static constexpr uint64_t range = 1ull << (levels * slot_bits);
+
+  // sentinels of circular lists
+  Node heads[levels][slots];
+  uint64_t occupied[levels] = {};
+  uint64_t current = 0;
+  size_t count = 0;
+  steady_clock::time_point origin = steady_clock::now();
+
+  uint64_t to_tick(steady_clock::time_point t) const {
+    if (t <= origin) {
+      return 0;
+    }
+    return duration_cast<milliseconds>(t - origin).count();
+  }
+
+  // a node cascading down on its own tick goes to the current slot, which
+  // advance drains right after the cascade
+  void link(Node *node) {
+    uint64_t delta = node->expires > current ? node->expires - current : 0;
+    uint64_t target = current + std::min(delta, range - 1);
+    int level = 0;
+    while (level < levels - 1 && delta >= 1ull << ((level + 1) * slot_bits)) {
+      level++;
+    }
+    int slot = (target >> (level * slot_bits)) & slot_mask;
+    Node *head = &heads[level][slot];
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+    occupied[level] |= 1ull << slot;
+  }
+
+  void unlink(Node *node, int level, int slot) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+    Node *head = &heads[level][slot];
+    if (head->next == head) {
+      occupied[level] &= ~(1ull << slot);
+    }
+  }
+
+  // moves the timers of the current slot of level down to lower levels
+  void cascade(int level) {
+    int slot = (current >> (level * slot_bits)) & slot_mask;
+    if (slot == 0 && level + 1 < levels) {
+      cascade(level + 1);
+    }
+    Node *head = &heads[level][slot];
+    while (head->next != head) {
+      Node *node = head->next;
+      unlink(node, level, slot);
+      link(node);
+    }
+  }
+
+ public:
+  TimerWheel() {
+    for (auto &level : heads) {
+      for (auto &head : level) {
+        head.prev = head.next = &head;
+      }
+    }
+  }
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  bool empty() const { return count == 0; }
+
+  void schedule(Node *node, steady_clock::time_point when) {
+    cancel(node);
+    node->expires = std::max(to_tick(when), current + 1);
+    link(node);
+    count++;
+  }
+
+  void cancel(Node *node) {
+    if (!node->linked()) {
+      return;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+    count--;
+    // the slot bit is cleared lazily by next_expiry and advance
+  }
+
+  // the earliest time the wheel needs to be advanced, if any timer is set
+  bool next_expiry(steady_clock::time_point &when) {
+    if (!count) {
+      return false;
+    }
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < levels; level++) {
+      int shift = level * slot_bits;
+      uint64_t index = current >> shift;
+      for (uint64_t d = 1; d <= slots; d++) {
+        int slot = (index + d) & slot_mask;
+        if (!(occupied[level] & (1ull << slot))) {
+          continue;
+        }
+        Node *head = &heads[level][slot];
+        if (head->next == head) {
+          occupied[level] &= ~(1ull << slot);
+          continue;
+        }
+        best = std::min(best, (index + d) << shift);
+        break;
+      }
+    }
+    if (best == UINT64_MAX) {
+      return false;
+    }
+    when = origin + milliseconds(best);
+    return true;
+  }
+
+  // fires every timer that expired by now, on_expire may schedule again
+  template <typename Callback>
+  void advance(steady_clock::time_point now, Callback on_expire) {
+    uint64_t target = to_tick(now);
+    while (current < target) {
+      if (!count) {
+        current = target;
+        break;
+      }
+      current++;
+      int slot = current & slot_mask;
+      if (slot == 0) {
+        cascade(1);
+      }
+      Node *head = &heads[0][slot];
+      while (head->next != head) {
+        Node *node = head->next;
+        unlink(node, 0, slot);
+        count--;
+        on_expire(node);
+      }
+      occupied[0] &= ~(1ull << slot);
+    }
+  }
+};
 
 struct TaskData {
-  std::vector<Field> header_entries = {};
+  // header lines of the response being received and their offsets into it,
+  // packed into Response::headers once the response is delivered
+  std::string header_data = {};
+  std::vector<Header> headers = {};
   Request request = {};
   ResponseCallback callback = {};
   DataHandler onData = {};
   ErrorHandler onError = {};
   Response response = {};
   Session *session = nullptr;
-  UploadState *upload_state = nullptr;
+  // hash of the url authority, see host_hash
+  uint64_t host = 0;
+  steady_clock::time_point enqueued_at;
+  steady_clock::time_point started_at;
+  // returned by flucurl_session_send_request, see Session::next_id
+  uint64_t id = 0;
+  // the easy handle while the request is running
+  CURL *curl = nullptr;
+  // Request::timeout_ms and Request::first_byte_timeout_ms
+  TimerWheel::Node deadline_timer;
+  TimerWheel::Node first_byte_timer;
+  bool first_byte_received = false;
+  // the slab response body chunks are appended to
+  Slab *slab = nullptr;
+  // a chunk held back to coalesce it with the next ones, flushed by
+  // flush_timer at the latest
+  BodyData *pending_body = nullptr;
+  TimerWheel::Node flush_timer;
+  Shard *shard = nullptr;
+  // the template the request was made from, holds a reference
+  TemplateData *request_template = nullptr;
+  // the header list of the request, header_tail is its last own entry when
+  // the list continues into the template's, see perform_request
+  curl_slist *header_list = nullptr;
+  curl_slist *header_tail = nullptr;
+  // the url resolved against the template's, when the request has a path
+  CURLU *url = nullptr;
+  // the CURLOPT_CONNECT_TO entry of Request::resolved_ip or the
+  // CURLOPT_RESOLVE entry of cached addresses
+  curl_slist *resolve_list = nullptr;
+  // a request of flucurl_session_preconnect, only there to leave its
+  // connection in the cache. Nothing is delivered, the url is a copy.
+  bool preconnect = false;
+  std::string preconnect_url;
+
+  // The request body queued by flucurl_upload_append. upload_state is what
+  // flucurl_session_send_request returns, its queue is this record and
+  // upload_mutex guards it all. Both stay valid while the record is pooled,
+  // so a late append finds a different request_id and is dropped.
+  UploadState upload_state = {};
+  std::queue<Field> upload_queue;
+  std::mutex upload_mutex;
+  // Request::content_length is set, bodiless requests never touch the
+  // upload state and its request_id stays 0
+  bool has_body = false;
+
+  // see TaskPool
+  TaskData *next_free = nullptr;
+  size_t pool_index = 0;
+
+  TaskData() {
+    upload_state.queue = this;
+    upload_state.mtx = &upload_mutex;
+  }
+
+  // prepares the record for the next request, the upload state is cleared
+  // by release_upload and the buffers keep their capacity
+  void reset() {
+    header_data.clear();
+    headers.clear();
+    request = {};
+    callback = {};
+    onData = {};
+    onError = {};
+    response = {};
+    session = nullptr;
+    host = 0;
+    enqueued_at = {};
+    started_at = {};
+    id = 0;
+    curl = nullptr;
+    deadline_timer = {};
+    first_byte_timer = {};
+    first_byte_received = false;
+    slab = nullptr;
+    pending_body = nullptr;
+    flush_timer = {};
+    shard = nullptr;
+    request_template = nullptr;
+    header_list = nullptr;
+    header_tail = nullptr;
+    url = nullptr;
+    resolve_list = nullptr;
+    preconnect = false;
+    preconnect_url.clear();
+    has_body = false;
+  }
+};
+
+// Free request records. Workers push finished records, submitters take the
+// whole list at once into a thread local cache, which avoids the ABA
+// problem of popping single records and any lock. A cache keeps at most
+// cache_limit records and gives the rest back. Beyond what the live sessions
+// can run at once, finished records are freed, except those that carried a
+// body: a late flucurl_upload_append may still lock them, see
+// TaskData::upload_state. The last session to end frees every record.
+class TaskPool {
+  static constexpr int cache_limit = 64;
+
+  struct Cache {
+    TaskData *list = nullptr;
+    uint64_t generation = 0;
+    // a thread that exits gives its records back
+    ~Cache();
+  };
+  static thread_local Cache cache;
+
+  std::atomic<TaskData *> head = nullptr;
+  // records in head, approximate while records move
+  std::atomic<int> idle = 0;
+  // the concurrency of the live sessions summed up
+  std::atomic<int> idle_limit = 0;
+  // bumped when every record was freed, caches of older generations are
+  // stale
+  std::atomic<uint64_t> generation = 1;
+
+  // only taken to allocate and free records and when sessions start or end
+  std::mutex records_mutex;
+  std::vector<TaskData *> records;
+  int sessions = 0;
+
+  void push(TaskData *first, TaskData *last, int count) {
+    idle.fetch_add(count, std::memory_order_relaxed);
+    last->next_free = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(last->next_free, first,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+    }
+  }
+
+  // moves up to cache_limit records of the shared list into the cache
+  void take() {
+    auto *first = head.exchange(nullptr, std::memory_order_acquire);
+    if (!first) {
+      return;
+    }
+    auto *last = first;
+    int count = 1;
+    while (last->next_free && count < cache_limit) {
+      last = last->next_free;
+      count++;
+    }
+    idle.fetch_sub(count, std::memory_order_relaxed);
+    cache.list = first;
+    auto *rest = last->next_free;
+    if (!rest) {
+      return;
+    }
+    last->next_free = nullptr;
+    TaskData *empty = nullptr;
+    // the list usually stays empty this short, otherwise walk to the end
+    if (!head.compare_exchange_strong(empty, rest, std::memory_order_release,
+                                      std::memory_order_relaxed)) {
+      auto *rest_last = rest;
+      while (rest_last->next_free) {
+        rest_last = rest_last->next_free;
+      }
+      push(rest, rest_last, 0);
+    }
+  }
+
+ public:
+  TaskData *acquire() {
+    auto current = generation.load(std::memory_order_acquire);
+    if (cache.generation != current) {
+      // the records were freed with the last session
+      cache = {nullptr, current};
+    }
+    if (!cache.list) {
+      take();
+    }
+    if (!cache.list) {
+      auto *task = new TaskData();
+      std::lock_guard lock(records_mutex);
+      task->pool_index = records.size();
+      records.push_back(task);
+      return task;
+    }
+    auto *task = cache.list;
+    cache.list = task->next_free;
+    task->next_free = nullptr;
+    return task;
+  }
+
+  void release(TaskData *task) {
+    bool had_body = task->has_body;
+    task->reset();
+    if (!had_body && idle.load(std::memory_order_relaxed) >=
+                         idle_limit.load(std::memory_order_relaxed)) {
+      std::lock_guard lock(records_mutex);
+      auto *moved = records.back();
+      moved->pool_index = task->pool_index;
+      records[moved->pool_index] = moved;
+      records.pop_back();
+      delete task;
+      return;
+    }
+    push(task, task, 1);
+  }
+
+  // a session starts, concurrency is how many of its requests run at once
+  void attach(int concurrency) {
+    std::lock_guard lock(records_mutex);
+    sessions++;
+    idle_limit += concurrency;
+  }
+
+  // a session ended and released its requests. Once none is left, no
+  // upload can be appended anymore and every record is freed.
+  void detach(int concurrency) {
+    std::lock_guard lock(records_mutex);
+    idle_limit -= concurrency;
+    if (--sessions > 0) {
+      return;
+    }
+    for (auto *task : records) {
+      delete task;
+    }
+    records.clear();
+    head = nullptr;
+    idle = 0;
+    generation++;
+  }
+
+  void give_back(Cache &exiting) {
+    if (!exiting.list) {
+      return;
+    }
+    std::lock_guard lock(records_mutex);
+    if (exiting.generation != generation) {
+      return;
+    }
+    auto *last = exiting.list;
+    int count = 1;
+    while (last->next_free) {
+      last = last->next_free;
+      count++;
+    }
+    push(exiting.list, last, count);
+  }
 };
 
+thread_local TaskPool::Cache TaskPool::cache;
+
 size_t write_callback(void *ptr, size_t size, size_t nmemb, void *userdata);
 size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userdata);
 size_t header_callback(void *ptr, size_t size, size_t nmemb, void *userdata);
+void pack_headers(TaskData *task);
+void release_upload(TaskData *task);
+int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp,
+                    void *socketp);
+int timer_callback(CURLM *multi, long timeout_ms, void *userp);
+
+void session_worker_func(Shard *shard);
+void session_cleanup(Session *session);
+
+// Bounded lock-free multi-producer/single-consumer ring (Vyukov's bounded
+// queue with a single dequeuer). Every cell carries a sequence number so
+// producers only contend on one fetch position and never on the consumer.
+template <typename T>
+class MpscRing {
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) size_t dequeue_pos = 0;
+
+ public:
+  // capacity must be a power of two
+  explicit MpscRing(size_t capacity)
+      : cells(new Cell[capacity]), mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // safe to call from any thread, returns false when the ring is full
+  bool try_push(T value) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells[pos & mask];
+      size_t seq = cell.sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // only call this from the consumer thread
+  bool try_pop(T &value) {
+    Cell &cell = cells[dequeue_pos & mask];
+    size_t seq = cell.sequence.load(std::memory_order_acquire);
+    if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(dequeue_pos + 1) <
+        0) {
+      return false;
+    }
+    value = cell.value;
+    cell.sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+    dequeue_pos++;
+    return true;
+  }
+};
+
+// Bounded lock-free single-producer/single-consumer ring.
+template <typename T>
+class SpscRing {
+  std::unique_ptr<T[]> cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+
+ public:
+  // capacity must be a power of two
+  explicit SpscRing(size_t capacity)
+      : cells(new T[capacity]), mask(capacity - 1) {}
+
+  // only call this from the producer thread
+  bool try_push(const T &value) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    if (pos - head.load(std::memory_order_acquire) > mask) {
+      return false;
+    }
+    cells[pos & mask] = value;
+    tail.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // only call this from the consumer thread
+  bool try_pop(T &value) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    if (pos == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = cells[pos & mask];
+    head.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// frees what an event undelivered to Dart still owns
+void free_event(const Event &event) {
+  if (event.type == EVENT_RESPONSE) {
+    flucurl_free_reponse(event.response);
+  } else if (event.type == EVENT_DATA && event.data) {
+    flucurl_free_bodydata(event.data);
+  }
+}
+
+// The part of Dart_CObject from dart_native_api.h that DELIVERY_PORT posts.
+// Config::post_cobject is Dart's NativeApi.postCObject, so neither the Dart
+// SDK headers nor Dart_InitializeApiDL are needed.
+enum DartCObjectType : int32_t {
+  DART_COBJECT_NULL = 0,
+  DART_COBJECT_INT32 = 2,
+  DART_COBJECT_INT64 = 3,
+  DART_COBJECT_STRING = 5,
+  DART_COBJECT_ARRAY = 6,
+  DART_COBJECT_TYPED_DATA = 7,
+  DART_COBJECT_EXTERNAL_TYPED_DATA = 8,
+};
+constexpr int32_t dart_typed_data_uint8 = 2;
+
+typedef void (*DartHandleFinalizer)(void *isolate_callback_data, void *peer);
+
+struct DartCObject {
+  DartCObjectType type;
+  union {
+    int32_t as_int32;
+    int64_t as_int64;
+    const char *as_string;
+    struct {
+      intptr_t length;
+      DartCObject **values;
+    } as_array;
+    struct {
+      int32_t type;
+      intptr_t length;
+      const uint8_t *values;
+    } as_typed_data;
+    struct {
+      int32_t type;
+      intptr_t length;
+      uint8_t *data;
+      void *peer;
+      DartHandleFinalizer callback;
+    } as_external_typed_data;
+  } value;
+};
+
+typedef bool (*DartPostCObject)(int64_t port, DartCObject *message);
+
+DartCObject dart_int32(int32_t value) {
+  DartCObject object{DART_COBJECT_INT32};
+  object.value.as_int32 = value;
+  return object;
+}
+
+DartCObject dart_int64(int64_t value) {
+  DartCObject object{DART_COBJECT_INT64};
+  object.value.as_int64 = value;
+  return object;
+}
+
+// copied into the message
+DartCObject dart_bytes(const char *data, int size) {
+  DartCObject object{DART_COBJECT_TYPED_DATA};
+  object.value.as_typed_data = {dart_typed_data_uint8, size,
+                                reinterpret_cast<const uint8_t *>(data)};
+  return object;
+}
+
+// finalizer of body chunks posted without a copy
+void free_posted_body(void *isolate_callback_data, void *peer) {
+  flucurl_free_bodydata(static_cast<BodyData *>(peer));
+}
+
+// owned by Dart once posted, released through free_posted_body
+DartCObject dart_body(BodyData *body_data) {
+  DartCObject object{DART_COBJECT_EXTERNAL_TYPED_DATA};
+  object.value.as_external_typed_data = {
+      dart_typed_data_uint8, body_data->size,
+      reinterpret_cast<uint8_t *>(body_data->data), body_data,
+      free_posted_body};
+  return object;
+}
+
+TaskPool task_pool;
+
+TaskPool::Cache::~Cache() { task_pool.give_back(*this); }
+// Hash of the authority part of the url ("user@host:port" without the
+// user info), case insensitive. Only used to pick a shard.
+uint64_t host_hash(const char *url) {
+  const char *p = std::strstr(url, "://");
+  p = p ? p + 3 : url;
+  const char *end = p + std::strcspn(p, "/?#");
+  if (auto *at = static_cast<const char *>(std::memchr(p, '@', end - p))) {
+    p = at + 1;
+  }
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ull;
+  for (; p < end; p++) {
+    char c = *p;
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// The name of a "name: value" header line, lower cased.
+std::string header_name(std::string_view line) {
+  std::string name(line.substr(0, line.find_first_of(":;")));
+  for (auto &c : name) {
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  }
+  return name;
+}
+
+// whether the request has a header of the same name as the header line
+bool has_request_header(const Request &request, std::string_view line) {
+  auto name = header_name(line);
+  for (int i = 0; i < request.header_count; i++) {
+    if (header_name(request.headers[i]) == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Host and port of an absolute url, the port defaults to the scheme's.
+// False if there is no host or the port is unknown.
+bool url_authority(std::string_view url, std::string_view &host, int &port) {
+  auto scheme_end = url.find("://");
+  if (scheme_end == std::string_view::npos) {
+    return false;
+  }
+  auto scheme = url.substr(0, scheme_end);
+  auto authority = url.substr(scheme_end + 3);
+  authority = authority.substr(0, authority.find_first_of("/?#"));
+  if (auto at = authority.rfind('@'); at != std::string_view::npos) {
+    authority = authority.substr(at + 1);
+  }
+  port = 0;
+  if (authority.empty()) {
+    return false;
+  }
+  // an IPv6 address keeps its brackets
+  auto port_start = authority.find(':', authority.front() == '[' ?
+                                            authority.find(']') : 0);
+  host = authority.substr(0, port_start);
+  if (port_start != std::string_view::npos) {
+    for (char c : authority.substr(port_start + 1)) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      port = port * 10 + (c - '0');
+    }
+  } else if (scheme.size() == 5 && std::tolower(scheme[4]) == 's') {
+    port = 443;
+  } else if (scheme.size() == 4) {
+    port = 80;
+  }
+  return !host.empty() && port > 0;
+}
+
+// Alt-Svc and HSTS knowledge of a session with Config::state_dir. Curl keeps
+// both per easy handle and a freed handle would overwrite the files with
+// what it alone learned, so handles report to this one store instead. It
+// merges their entries, the later expiry wins, and alone writes the files.
+// - HSTS goes through CURLOPT_HSTSREADFUNCTION, which hands a handle the
+//   entries it has not read yet, and CURLOPT_HSTSWRITEFUNCTION, which curl
+//   calls with all entries of a handle as it is freed.
+// - Alt-Svc has no callbacks. A new handle loads alt-svc.txt, a retired one
+//   saves to a scratch file that is merged here.
+// TLS sessions are not kept: curl 8.11.1 has no API to export or import
+// them (curl_easy_ssls_export came with 8.12.0). Within a process the share
+// handle resumes them.
+class StateStore {
+  struct HstsEntry {
+    bool subdomains;
+    // "YYYYMMDD HH:MM:SS" or "unlimited", which sorts after any date
+    std::string expire;
+    // hsts_version when it last changed
+    uint64_t version;
+  };
+
+  std::filesystem::path dir;
+  std::mutex mutex;
+  std::map<std::string, HstsEntry> hsts;
+  uint64_t hsts_version = 1;
+  // the hsts_version each handle has read up to
+  std::unordered_map<CURL *, uint64_t> hsts_read;
+  // lines of curl's file format by their origin and alternative
+  std::map<std::string, std::string> alt_svc;
+  bool dirty = false;
+
+  static constexpr const char *unlimited = "unlimited";
+
+  // only call this with mutex held
+  void merge_hsts(std::string name, bool subdomains, std::string expire) {
+    auto it = hsts.find(name);
+    if (it != hsts.end() && (it->second.expire > expire ||
+                             (it->second.expire == expire &&
+                              it->second.subdomains == subdomains))) {
+      return;
+    }
+    hsts[std::move(name)] = {subdomains, std::move(expire), ++hsts_version};
+    dirty = true;
+  }
+
+  // only call this with mutex held, a line of curl's alt-svc file:
+  // h2 example.com 443 h3 example.com 443 "20250101 00:00:00" 0 0
+  void merge_alt_svc(const std::string &line) {
+    auto quote = line.find('"');
+    if (line[0] == '#' || quote == std::string::npos) {
+      return;
+    }
+    auto end = line.find('"', quote + 1);
+    if (end == std::string::npos) {
+      return;
+    }
+    auto key = line.substr(0, quote);
+    auto it = alt_svc.find(key);
+    if (it != alt_svc.end() &&
+        it->second.compare(quote, end - quote, line, quote, end - quote) >=
+            0) {
+      return;
+    }
+    alt_svc[key] = line;
+    dirty = true;
+  }
+
+  // only call this with mutex held
+  void merge_alt_svc_file(const std::filesystem::path &path) {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      merge_alt_svc(line);
+    }
+  }
+
+  static void write_file(const std::filesystem::path &path,
+                         const std::string &content) {
+    auto temp = path;
+    temp += ".tmp";
+    {
+      std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+      file << content;
+      if (!file) {
+        return;
+      }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp, path, error);
+  }
+
+  static CURLSTScode read_hsts(CURL *curl, curl_hstsentry *entry,
+                               void *userp) {
+    // curl asks for one entry after another on the handle's thread
+    thread_local CURL *reading = nullptr;
+    thread_local std::vector<std::pair<std::string, HstsEntry>> unread;
+    auto *store = static_cast<StateStore *>(userp);
+    if (reading != curl) {
+      reading = curl;
+      unread.clear();
+      std::lock_guard lock(store->mutex);
+      auto &read = store->hsts_read[curl];
+      for (auto &[name, stored] : store->hsts) {
+        if (stored.version > read) {
+          unread.emplace_back(name, stored);
+        }
+      }
+      read = store->hsts_version;
+    }
+    while (!unread.empty() && unread.back().first.size() > entry->namelen) {
+      unread.pop_back();
+    }
+    if (unread.empty()) {
+      reading = nullptr;
+      return CURLSTS_DONE;
+    }
+    auto &[name, stored] = unread.back();
+    std::memcpy(entry->name, name.c_str(), name.size() + 1);
+    entry->includeSubDomains = stored.subdomains;
+    // an empty expiry never expires
+    std::snprintf(entry->expire, sizeof(entry->expire), "%s",
+                  stored.expire == unlimited ? "" : stored.expire.c_str());
+    unread.pop_back();
+    return CURLSTS_OK;
+  }
+
+  static CURLSTScode write_hsts(CURL *curl, curl_hstsentry *entry,
+                                curl_index *index, void *userp) {
+    auto *store = static_cast<StateStore *>(userp);
+    std::lock_guard lock(store->mutex);
+    store->merge_hsts(entry->name, entry->includeSubDomains, entry->expire);
+    return CURLSTS_OK;
+  }
+
+ public:
+  // loads the files saved last time
+  explicit StateStore(std::filesystem::path state_dir)
+      : dir(std::move(state_dir)) {
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    std::ifstream file(dir / "hsts.txt");
+    std::string line;
+    while (std::getline(file, line)) {
+      // [.]example.com "20250101 00:00:00", the dot for subdomains
+      bool subdomains = line[0] == '.';
+      auto space = line.find(' ');
+      auto quote = line.find('"');
+      if (line[0] == '#' || space == std::string::npos ||
+          space <= static_cast<size_t>(subdomains) ||
+          quote == std::string::npos ||
+          line.find('"', quote + 1) == std::string::npos) {
+        continue;
+      }
+      auto end = line.find('"', quote + 1);
+      merge_hsts(line.substr(subdomains, space - subdomains), subdomains,
+                 line.substr(quote + 1, end - quote - 1));
+    }
+    merge_alt_svc_file(dir / "alt-svc.txt");
+    dirty = false;
+  }
+
+  // sets a handle up to read from and report to the store, on the
+  // prototype it applies to every copy
+  void configure(CURL *curl) {
+    curl_easy_setopt(curl, CURLOPT_ALTSVC_CTRL,
+                     CURLALTSVC_H1 | CURLALTSVC_H2 | CURLALTSVC_H3);
+    curl_easy_setopt(curl, CURLOPT_HSTS_CTRL, CURLHSTS_ENABLE);
+    curl_easy_setopt(curl, CURLOPT_HSTSREADFUNCTION, read_hsts);
+    curl_easy_setopt(curl, CURLOPT_HSTSREADDATA, this);
+    curl_easy_setopt(curl, CURLOPT_HSTSWRITEFUNCTION, write_hsts);
+    curl_easy_setopt(curl, CURLOPT_HSTSWRITEDATA, this);
+  }
+
+  // a new handle, loads the Alt-Svc entries saved last from disk, only
+  // called off the workers by HandleReaper
+  void attach(CURL *curl) {
+    curl_easy_setopt(curl, CURLOPT_ALTSVC,
+                     (dir / "alt-svc.txt").string().c_str());
+  }
+
+  // frees a handle and merges what it learned
+  void retire(CURL *curl) {
+    auto scratch = dir / ("alt-svc-" +
+                          std::to_string(reinterpret_cast<uintptr_t>(curl)) +
+                          ".txt");
+    curl_easy_setopt(curl, CURLOPT_ALTSVC, scratch.string().c_str());
+    {
+      // the address may be reused by the next handle
+      std::lock_guard lock(mutex);
+      hsts_read.erase(curl);
+    }
+    // calls write_hsts for each entry and saves the Alt-Svc cache
+    curl_easy_cleanup(curl);
+    std::lock_guard lock(mutex);
+    merge_alt_svc_file(scratch);
+    std::error_code error;
+    std::filesystem::remove(scratch, error);
+  }
+
+  // writes the files if anything changed since the last save, not
+  // concurrently with itself
+  void save() {
+    std::string hsts_file =
+        "# Your HSTS cache. https://curl.se/docs/hsts.html\n";
+    std::string alt_svc_file =
+        "# Your alt-svc cache. https://curl.se/docs/alt-svc.html\n";
+    {
+      std::lock_guard lock(mutex);
+      if (!dirty) {
+        return;
+      }
+      dirty = false;
+      for (auto &[name, entry] : hsts) {
+        hsts_file.append(entry.subdomains ? "." : "")
+            .append(name)
+            .append(" \"")
+            .append(entry.expire)
+            .append("\"\n");
+      }
+      for (auto &[key, line] : alt_svc) {
+        alt_svc_file.append(line).append("\n");
+      }
+    }
+    write_file(dir / "hsts.txt", hsts_file);
+    write_file(dir / "alt-svc.txt", alt_svc_file);
+  }
+};
+
+// Frees easy handles of a session with Config::state_dir on its own thread
+// and saves the state every flush_interval. Freeing a handle reads back
+// its Alt-Svc file, which must not stall a worker. Curl only loads Alt-Svc
+// entries from a file, so it also keeps a few new handles ready with them
+// loaded, the first ones while the session starts.
+class HandleReaper {
+  StateStore &store;
+  CURL *prototype;
+  steady_clock::duration flush_interval;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<CURL *> pending;
+  std::vector<CURL *> spares;
+  static constexpr size_t spare_count = 4;
+  bool stopping = false;
+  std::thread thread;
+
+  CURL *prepare() {
+    CURL *curl = curl_easy_duphandle(prototype);
+    store.attach(curl);
+    return curl;
+  }
+
+  void run() {
+    std::unique_lock lock(mutex);
+    auto next_flush = steady_clock::now() + flush_interval;
+    while (true) {
+      cv.wait_until(lock, next_flush, [this] {
+        return stopping || !pending.empty() || spares.size() < spare_count;
+      });
+      auto handles = std::move(pending);
+      pending.clear();
+      bool stop = stopping;
+      size_t missing = stop ? 0 : spare_count - spares.size();
+      lock.unlock();
+      for (auto *curl : handles) {
+        store.retire(curl);
+      }
+      std::vector<CURL *> prepared;
+      for (size_t i = 0; i < missing; i++) {
+        prepared.push_back(prepare());
+      }
+      if (steady_clock::now() >= next_flush) {
+        store.save();
+        next_flush = steady_clock::now() + flush_interval;
+      }
+      lock.lock();
+      spares.insert(spares.end(), prepared.begin(), prepared.end());
+      if (stop && pending.empty()) {
+        return;
+      }
+    }
+  }
+
+ public:
+  // the prototype must not change anymore
+  HandleReaper(StateStore &store, CURL *prototype,
+               steady_clock::duration flush_interval)
+      : store(store), prototype(prototype), flush_interval(flush_interval) {
+    for (size_t i = 0; i < spare_count; i++) {
+      spares.push_back(prepare());
+    }
+    thread = std::thread([this] { run(); });
+  }
+
+  // frees the handles still queued and the spares
+  ~HandleReaper() {
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    thread.join();
+    for (auto *curl : spares) {
+      store.retire(curl);
+    }
+  }
+
+  // safe to call from any thread, a new handle with the saved Alt-Svc
+  // entries or null if none is ready
+  CURL *take() {
+    CURL *curl = nullptr;
+    {
+      std::lock_guard lock(mutex);
+      if (spares.empty()) {
+        return nullptr;
+      }
+      curl = spares.back();
+      spares.pop_back();
+    }
+    cv.notify_one();
+    return curl;
+  }
+
+  // safe to call from any thread, the handle must not be used anymore
+  void dispose(CURL *curl) {
+    {
+      std::lock_guard lock(mutex);
+      pending.push_back(curl);
+    }
+    cv.notify_one();
+  }
+};
+
+// The addresses joined in the format of CURLOPT_RESOLVE, each once.
+// getaddrinfo returns an address for every socket type and protocol. Whole
+// entries are compared, 10.0.0.1 is not contained in 10.0.0.11.
+std::string join_addresses(const std::vector<std::string> &entries) {
+  std::string addresses;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (std::find(entries.begin(), entries.begin() + i, entries[i]) !=
+        entries.begin() + i) {
+      continue;
+    }
+    if (!addresses.empty()) {
+      addresses += ',';
+    }
+    addresses += entries[i];
+  }
+  return addresses;
+}
+
+// Addresses of hosts resolved ahead of their requests by
+// flucurl_session_prefetch_dns, and hosts that failed to resolve, each kept
+// for a while. Curl gets fresh addresses as CURLOPT_RESOLVE entries, which
+// then live in its own cache; a fresh failure fails requests right away.
+class DnsCache {
+  struct Entry {
+    // comma separated, empty when the host did not resolve
+    std::string addresses;
+    steady_clock::time_point expires;
+    // ports curl got the addresses for already
+    std::vector<int> given;
+  };
+
+  std::mutex mutex;
+  std::map<std::string, Entry, std::less<>> entries;
+  // lets requests skip the lock while nothing is cached
+  std::atomic<size_t> count = 0;
+  steady_clock::duration ttl;
+  // negative for not caching failures
+  steady_clock::duration negative_ttl;
+
+  // hosts to prefetch, resolved one after the other by a thread started
+  // with the first prefetch
+  std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+  std::deque<std::string> queue;
+  bool stopping = false;
+  std::unique_ptr<std::thread> resolver;
+
+  // comma separated addresses in the format of CURLOPT_RESOLVE
+  static std::string resolve(const std::string &host) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0) {
+      return {};
+    }
+    std::vector<std::string> entries;
+    for (auto *info = result; info; info = info->ai_next) {
+      char address[NI_MAXHOST];
+      if (getnameinfo(info->ai_addr, static_cast<socklen_t>(info->ai_addrlen),
+                      address, sizeof(address), nullptr, 0,
+                      NI_NUMERICHOST) != 0) {
+        continue;
+      }
+      entries.push_back(info->ai_family == AF_INET6
+                            ? "[" + std::string(address) + "]"
+                            : address);
+    }
+    freeaddrinfo(result);
+    return join_addresses(entries);
+  }
+
+  void resolve_loop() {
+    std::unique_lock lock(queue_mutex);
+    while (true) {
+      queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+      if (stopping) {
+        return;
+      }
+      auto host = std::move(queue.front());
+      queue.pop_front();
+      lock.unlock();
+      store(host, resolve(host));
+      lock.lock();
+    }
+  }
+
+  // only call this with mutex held, removes the entry if it expired
+  Entry *find(std::string_view host) {
+    auto it = entries.find(host);
+    if (it == entries.end()) {
+      return nullptr;
+    }
+    if (it->second.expires <= steady_clock::now()) {
+      entries.erase(it);
+      count--;
+      return nullptr;
+    }
+    return &it->second;
+  }
+
+ public:
+  enum Lookup { DNS_MISS, DNS_FOUND, DNS_FAILED };
+
+  DnsCache(steady_clock::duration ttl, steady_clock::duration negative_ttl)
+      : ttl(ttl), negative_ttl(negative_ttl) {}
+
+  ~DnsCache() {
+    {
+      std::lock_guard lock(queue_mutex);
+      stopping = true;
+    }
+    queue_cv.notify_one();
+    if (resolver) {
+      resolver->join();
+    }
+  }
+
+  // safe to call from any thread. DNS_FOUND sets addresses unless curl
+  // already has them for the port.
+  Lookup lookup(std::string_view host, int port, std::string &addresses) {
+    if (count.load(std::memory_order_relaxed) == 0) {
+      return DNS_MISS;
+    }
+    std::lock_guard lock(mutex);
+    auto *entry = find(host);
+    if (!entry) {
+      return DNS_MISS;
+    }
+    if (entry->addresses.empty()) {
+      return DNS_FAILED;
+    }
+    if (std::find(entry->given.begin(), entry->given.end(), port) !=
+        entry->given.end()) {
+      return DNS_MISS;
+    }
+    entry->given.push_back(port);
+    addresses = entry->addresses;
+    return DNS_FOUND;
+  }
+
+  // safe to call from any thread, empty addresses for a failure
+  void store(std::string_view host, std::string addresses) {
+    if (addresses.empty() && negative_ttl < steady_clock::duration::zero()) {
+      return;
+    }
+    std::lock_guard lock(mutex);
+    auto it = entries.find(host);
+    if (it == entries.end()) {
+      it = entries.emplace(std::string(host), Entry()).first;
+      count++;
+    }
+    it->second.expires =
+        steady_clock::now() + (addresses.empty() ? negative_ttl : ttl);
+    it->second.addresses = std::move(addresses);
+    it->second.given.clear();
+  }
+
+  // safe to call from any thread, hosts with a fresh entry are skipped
+  void prefetch(const char **hosts, int host_count) {
+    std::vector<std::string> pending;
+    {
+      std::lock_guard lock(mutex);
+      for (int i = 0; i < host_count; i++) {
+        if (hosts[i] && *hosts[i] && !find(hosts[i])) {
+          pending.emplace_back(hosts[i]);
+        }
+      }
+    }
+    if (pending.empty()) {
+      return;
+    }
+    {
+      std::lock_guard lock(queue_mutex);
+      for (auto &host : pending) {
+        if (std::find(queue.begin(), queue.end(), host) == queue.end()) {
+          queue.push_back(std::move(host));
+        }
+      }
+      if (!resolver) {
+        resolver = std::make_unique<std::thread>([this] { resolve_loop(); });
+      }
+    }
+    queue_cv.notify_one();
+  }
+};
+
+// A request template of flucurl_session_create_template. Its url handle and
+// header list are built once and only read by the requests using it, which
+// hold a reference so it outlives its removal until they finish.
+struct TemplateData {
+  std::atomic<int> refs = 1;
+  CURLU *url = nullptr;
+  std::string method;
+  curl_slist *headers = nullptr;
+  // see header_name, a request header of the same name replaces the
+  // template's
+  std::vector<std::string> header_names;
+  // see host_hash
+  uint64_t host = 0;
+  // see url_authority
+  std::string host_name;
+  int port = 0;
+
+  ~TemplateData() {
+    curl_url_cleanup(url);
+    curl_slist_free_all(headers);
+  }
+
+  void retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+
+  void release() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  bool has_header(std::string_view line) const {
+    return std::find(header_names.begin(), header_names.end(),
+                     header_name(line)) != header_names.end();
+  }
+};
+
+// Host and port the request goes to, see url_authority.
+bool request_authority(TaskData *task, std::string_view &host, int &port) {
+  const char *url = task->request.url;
+  auto *request_template = task->request_template;
+  if (request_template && (!url || !std::strstr(url, "://"))) {
+    host = request_template->host_name;
+    port = request_template->port;
+    return !host.empty() && port > 0;
+  }
+  return url && url_authority(url, host, port);
+}
+
+// whether host is an address, which curl does not resolve
+bool is_address(std::string_view host) {
+  return host.front() == '[' ||
+         host.find_first_not_of("0123456789.") == std::string_view::npos;
+}
+
+constexpr int priority_count = PRIORITY_LOW + 1;
+
+// AIMD concurrency limit of one host. The baseline is the lowest time to
+// first byte seen recently; while samples stay close to it the limit grows
+// by about one per window of completions, errors and slow samples shrink it
+// multiplicatively, at most once per baseline round trip.
+class ConcurrencyLimiter {
+  // samples slower than tolerance * baseline count as congestion
+  static constexpr double tolerance = 2.0;
+  static constexpr double backoff = 0.8;
+
+  double current;
+  double baseline_us = 0;
+  steady_clock::time_point last_decrease;
+
+ public:
+  int min_limit;
+  int max_limit;
+
+  ConcurrencyLimiter(int min_limit, int max_limit, int initial)
+      : current(initial), min_limit(min_limit), max_limit(max_limit) {}
+
+  int limit() const { return static_cast<int>(current); }
+
+  void on_sample(double latency_us, bool overloaded, int in_flight,
+                 steady_clock::time_point now) {
+    if (baseline_us == 0 || latency_us < baseline_us) {
+      baseline_us = latency_us;
+    } else {
+      // drift upwards slowly so a stale minimum does not pin the limit
+      baseline_us += (latency_us - baseline_us) * 0.001;
+    }
+    if (overloaded || latency_us > baseline_us * tolerance) {
+      auto rtt = microseconds(static_cast<int64_t>(baseline_us));
+      if (now - last_decrease >= rtt) {
+        current = std::max<double>(min_limit, current * backoff);
+        last_decrease = now;
+      }
+    } else if (in_flight * 2 >= current) {
+      // only grow while the limit is actually being used
+      current = std::min<double>(max_limit, current + 1.0 / current);
+    }
+  }
+};
+
+// Pending requests of one shard. Priority classes are served strictly in
+// order, hosts inside a class share it with deficit round-robin so one slow
+// host with a deep queue cannot starve the others.
+class Scheduler {
+  // cost unit of a request body, a request costs 1 + body / unit
+  static constexpr int cost_unit = 16 * 1024;
+  // credit a host gets every time it reaches the front
+  static constexpr int quantum = 4;
+
+  struct HostQueue {
+    std::deque<TaskData *> tasks;
+    int deficit = 0;
+    bool in_turn = false;
+  };
+
+  struct PriorityClass {
+    // unordered_map keeps the address of its values stable
+    std::unordered_map<uint64_t, HostQueue> hosts;
+    std::deque<uint64_t> active;
+  };
+
+  PriorityClass classes[priority_count];
+  size_t pending[priority_count] = {};
+
+  static int cost(TaskData *task) {
+    return 1 + std::max(task->request.content_length, 0) / cost_unit;
+  }
+
+ public:
+  static int priority_of(const Request &request) {
+    return std::clamp(static_cast<int>(request.priority), 0,
+                      priority_count - 1);
+  }
+
+  bool empty() const {
+    for (auto n : pending) {
+      if (n) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t size(int priority) const { return pending[priority]; }
+
+  // removes a pending task, returns false if it is not queued
+  bool remove(TaskData *task) {
+    int priority = priority_of(task->request);
+    auto &cls = classes[priority];
+    auto it = cls.hosts.find(task->host);
+    if (it == cls.hosts.end()) {
+      return false;
+    }
+    auto &tasks = it->second.tasks;
+    auto pos = std::find(tasks.begin(), tasks.end(), task);
+    if (pos == tasks.end()) {
+      return false;
+    }
+    tasks.erase(pos);
+    pending[priority]--;
+    if (tasks.empty()) {
+      cls.active.erase(
+          std::find(cls.active.begin(), cls.active.end(), task->host));
+      cls.hosts.erase(it);
+    }
+    return true;
+  }
+
+  void push(TaskData *task) {
+    int priority = priority_of(task->request);
+    auto &cls = classes[priority];
+    auto &queue = cls.hosts[task->host];
+    if (queue.tasks.empty()) {
+      cls.active.push_back(task->host);
+    }
+    queue.tasks.push_back(task);
+    pending[priority]++;
+  }
+
+  // pops the next task whose host satisfies can_start
+  template <typename Predicate>
+  TaskData *pop(Predicate can_start) {
+    for (int priority = 0; priority < priority_count; priority++) {
+      auto &cls = classes[priority];
+      // hosts skipped in a row because they are at their limit
+      size_t blocked = 0;
+      // hosts skipped in a row for any reason, and the fewest turns one of
+      // those short of credit still needs
+      size_t skipped = 0;
+      int turns = INT_MAX;
+      while (!cls.active.empty() && blocked < cls.active.size()) {
+        uint64_t host = cls.active.front();
+        auto it = cls.hosts.find(host);
+        auto &queue = it->second;
+        if (!can_start(host)) {
+          queue.deficit = 0;
+          queue.in_turn = false;
+          cls.active.pop_front();
+          cls.active.push_back(host);
+          blocked++;
+          skipped++;
+          continue;
+        }
+        if (!queue.in_turn) {
+          queue.deficit += quantum;
+          queue.in_turn = true;
+        }
+        TaskData *task = queue.tasks.front();
+        int c = cost(task);
+        if (c > queue.deficit) {
+          // not enough credit left, move on to the next host
+          queue.in_turn = false;
+          cls.active.pop_front();
+          cls.active.push_back(host);
+          blocked = 0;
+          skipped++;
+          turns = std::min(turns, (c - queue.deficit + quantum - 1) / quantum);
+          if (skipped == cls.active.size()) {
+            // a whole round served nothing: grant the rounds that would
+            // pass empty before the closest host has enough credit at once
+            // instead of going round for large bodies
+            for (auto other : cls.active) {
+              if (can_start(other)) {
+                cls.hosts.find(other)->second.deficit +=
+                    (turns - 1) * quantum;
+              }
+            }
+            skipped = 0;
+            turns = INT_MAX;
+          }
+          continue;
+        }
+        queue.deficit -= c;
+        queue.tasks.pop_front();
+        pending[priority]--;
+        if (queue.tasks.empty()) {
+          cls.active.pop_front();
+          cls.hosts.erase(it);
+        }
+        return task;
+      }
+    }
+    return nullptr;
+  }
+};
+
+#ifdef FLUCURL_USE_EPOLL
+// Drives the sockets and timers of one or more shards from a single thread
+// with an epoll set. LOOP_SOCKET_ACTION shards own a private loop,
+// LOOP_SHARED shards of any session attach to a loop of the global pool.
+// The thread starts when the first shard attaches and exits with the last.
+class EventLoop {
+ public:
+  int epoll_fd = -1;
+  int wakeup_fd = -1;
+  // which shard a registered socket belongs to, only touched by the loop
+  // thread
+  std::unordered_map<curl_socket_t, Shard *> sockets;
+
+  explicit EventLoop(bool shared);
+  ~EventLoop();
+
+  // safe to call from any thread
+  void wakeup() {
+    uint64_t one = 1;
+    [[maybe_unused]] auto n = write(wakeup_fd, &one, sizeof(one));
+  }
+
+  // safe to call from any thread
+  void attach(Shard *shard);
+  // blocks until the loop no longer touches the shard, not to be called by
+  // the loop thread
+  void detach(Shard *shard);
+
+ private:
+  const bool shared;
+  std::mutex mtx;
+  std::condition_variable detached;
+  // guarded by mtx
+  std::vector<Shard *> attaching;
+  std::vector<Shard *> detaching;
+  bool running = false;
+  std::unique_ptr<std::thread> thread;
+  // only touched by the loop thread
+  std::vector<Shard *> shards;
+
+  void run();
+  void release(Shard *shard);
+};
+#endif
+
+// A shard owns one multi handle, its easy handle pool and the worker thread
+// driving them. Requests are routed to shards by host, so every connection
+// in the shared cache is only ever driven by one worker.
+class Shard {
+ public:
+  struct HostState {
+    int in_flight = 0;
+    std::optional<ConcurrencyLimiter> limiter;
+  };
+
+  // only call this in worker thread
+  bool can_acquire_handle() const {
+    return !handles.empty() || total_handle < max_handles;
+  }
+
+  // only call this in worker thread
+  CURL *acquire_handle();
+
+  // only call this in worker thread
+  void release_handle(CURL *curl) {
+    handles.push_back({curl, steady_clock::now()});
+  }
+
+  // only call this in worker thread
+  void free_handle(CURL *curl) {
+    if (reaper) {
+      reaper->dispose(curl);
+    } else {
+      curl_easy_cleanup(curl);
+    }
+    total_handle--;
+  }
+
+  // only call this in worker thread
+  // free handles that stayed idle for too long, keeping min_idle_handles
+  void trim_handles() {
+    auto now = steady_clock::now();
+    auto expired = now - handle_idle_timeout;
+    while (handles.size() > min_idle_handles &&
+           handles.front().since <= expired) {
+      free_handle(handles.front().curl);
+      handles.pop_front();
+    }
+    // handles report their Alt-Svc and HSTS entries to the session's store
+    // when they are freed, so after new transfers the longest idle one goes
+    // now and then
+    if (state_dirty && !handles.empty() && now >= next_state_flush) {
+      free_handle(handles.front().curl);
+      handles.pop_front();
+      state_dirty = false;
+      next_state_flush = now + state_flush_interval;
+    }
+  }
+
+  // only call this in worker thread
+  // when the worker has to run next without socket activity: curl's timer,
+  // the next idle handle trim or request deadline
+  bool next_deadline(steady_clock::time_point &when) {
+    bool found = timer_armed;
+    when = timer_deadline;
+    auto consider = [&](steady_clock::time_point t) {
+      if (!found || t < when) {
+        when = t;
+        found = true;
+      }
+    };
+    if (handles.size() > min_idle_handles) {
+      consider(handles.front().since + handle_idle_timeout);
+    }
+    if (state_dirty && !handles.empty()) {
+      consider(next_state_flush);
+    }
+    steady_clock::time_point expiry;
+    if (timers.next_expiry(expiry)) {
+      consider(expiry);
+    }
+    if (closing) {
+      consider(close_deadline);
+    } else if (worker_idle_timeout != steady_clock::duration::zero() &&
+               tasks_by_id.empty()) {
+      consider(idle_since + worker_idle_timeout);
+    }
+    return found;
+  }
+
+  // only call this in worker thread
+  bool host_can_start(uint64_t host) const {
+    auto it = hosts.find(host);
+    if (it == hosts.end()) {
+      return true;
+    }
+    auto &state = it->second;
+    if (max_handles_per_host && state.in_flight >= max_handles_per_host) {
+      return false;
+    }
+    return !state.limiter || state.in_flight < state.limiter->limit();
+  }
+
+  // only call this in worker thread
+  HostState &host_state(uint64_t host) {
+    auto [it, inserted] = hosts.try_emplace(host);
+    if (inserted && adaptive) {
+      it->second.limiter.emplace(adaptive_min, adaptive_max,
+                                 std::clamp(8, adaptive_min, adaptive_max));
+    }
+    return it->second;
+  }
+
+  // only call this in worker thread
+  // feed the adaptive limiter of the host with a finished transfer
+  void sample_host(CURL *curl, TaskData *task, CURLcode result) {
+    auto &state = host_state(task->host);
+    if (!state.limiter) {
+      return;
+    }
+    curl_off_t ttfb_us = 0;
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    bool overloaded = result != CURLE_OK || status == 429 || status >= 500;
+    if (!ttfb_us) {
+      // nothing received, fall back to the time spent so far
+      ttfb_us = duration_cast<microseconds>(steady_clock::now() -
+                                            task->started_at)
+                    .count();
+    }
+    state.limiter->on_sample(static_cast<double>(ttfb_us), overloaded,
+                             state.in_flight, steady_clock::now());
+  }
+
+  // only call this in worker thread
+  // drop idle hosts once the table grows, their limits are relearned
+  void prune_hosts() {
+    if (hosts.size() < 256) {
+      return;
+    }
+    std::erase_if(hosts, [](auto &entry) { return !entry.second.in_flight; });
+  }
+
+  // only call this in worker thread
+  void perform_request(CURL *curl, TaskData *task) {
+    Request request = task->request;
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, task);
+
+    // set header receive callback
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, task);
+
+    // set body receive callback
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, task);
+
+    // set http method, handles are reused so every option is set again
+    auto *request_template = task->request_template;
+    const char *method_name = request.method ? request.method
+                              : request_template
+                                  ? request_template->method.c_str()
+                                  : "GET";
+    std::string_view method = method_name;
+    const char *custom = nullptr;
+    if (task->has_body) {
+      curl_easy_setopt(curl, CURLOPT_POST, 1L);
+      curl_easy_setopt(curl, CURLOPT_READDATA, task);
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                       static_cast<curl_off_t>(request.content_length));
+      if (method != "POST") {
+        custom = method_name;
+      }
+    } else if (method == "HEAD") {
+      curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    } else {
+      curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+      if (method != "GET") {
+        custom = method_name;
+      }
+    }
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, custom);
+
+    // set http headers, the template's list is linked behind the request's
+    // own headers unless they replace one of it
+    bool replaces = false;
+    for (int i = 0; i < request.header_count; i++) {
+      task->header_list =
+          curl_slist_append(task->header_list, request.headers[i]);
+      replaces = replaces ||
+                 (request_template && request_template->has_header(
+                                          request.headers[i]));
+    }
+    if (request_template && request_template->headers) {
+      if (replaces) {
+        for (auto *item = request_template->headers; item;
+             item = item->next) {
+          if (!has_request_header(request, item->data)) {
+            task->header_list = curl_slist_append(task->header_list,
+                                                  item->data);
+          }
+        }
+      } else if (task->header_list) {
+        task->header_tail = task->header_list;
+        while (task->header_tail->next) {
+          task->header_tail = task->header_tail->next;
+        }
+        task->header_tail->next = request_template->headers;
+      }
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER,
+                     task->header_list ? task->header_list
+                     : request_template ? request_template->headers
+                                        : nullptr);
+
+    // set url, a template's is parsed already
+    CURLcode ret;
+    if (!request_template) {
+      curl_easy_setopt(curl, CURLOPT_CURLU, nullptr);
+      ret = request.url ? curl_easy_setopt(curl, CURLOPT_URL, request.url)
+                        : CURLE_URL_MALFORMAT;
+    } else if (!request.url || !*request.url) {
+      ret = curl_easy_setopt(curl, CURLOPT_CURLU, request_template->url);
+    } else {
+      task->url = curl_url_dup(request_template->url);
+      ret = curl_url_set(task->url, CURLUPART_URL, request.url, 0) == CURLUE_OK
+                ? curl_easy_setopt(curl, CURLOPT_CURLU, task->url)
+                : CURLE_URL_MALFORMAT;
+    }
+    if (ret != CURLE_OK) {
+      deliver_error(task, "Unable to set URL");
+      release_task(task);
+      release_handle(curl);
+      return;
+    }
+
+    // set addresses, the ip resolved by the caller goes first
+    std::string_view host;
+    int port = 0;
+    std::string resolve;
+    bool known = request_authority(task, host, port) && !is_address(host);
+    if (known && request.resolved_ip && *request.resolved_ip) {
+      // "host::ip:" connects to ip for any port of host
+      std::string_view ip = request.resolved_ip;
+      bool bracket = ip.find(':') != std::string_view::npos && ip[0] != '[';
+      resolve.append(host).append("::");
+      resolve.append(bracket ? "[" : "").append(ip).append(bracket ? "]" : "");
+      resolve.append(":");
+      task->resolve_list = curl_slist_append(nullptr, resolve.c_str());
+    } else if (known) {
+      std::string addresses;
+      switch (dns->lookup(host, port, addresses)) {
+        case DnsCache::DNS_FAILED:
+          deliver_error(task, curl_easy_strerror(CURLE_COULDNT_RESOLVE_HOST));
+          release_task(task);
+          release_handle(curl);
+          return;
+        case DnsCache::DNS_FOUND:
+          // "+" lets curl's cache expire the entry like a resolved one
+          resolve.append("+").append(host).append(":");
+          resolve.append(std::to_string(port)).append(":").append(addresses);
+          task->resolve_list = curl_slist_append(nullptr, resolve.c_str());
+          break;
+        case DnsCache::DNS_MISS:
+          break;
+      }
+    }
+    bool connect_to = request.resolved_ip && *request.resolved_ip;
+    curl_easy_setopt(curl, CURLOPT_CONNECT_TO,
+                     connect_to ? task->resolve_list : nullptr);
+    curl_easy_setopt(curl, CURLOPT_RESOLVE,
+                     connect_to ? nullptr : task->resolve_list);
+    task->curl = curl;
+    task->started_at = steady_clock::now();
+    host_state(task->host).in_flight++;
+
+    curl_multi_add_handle(multi_handle, curl);
+  }
+
+  Session *session = nullptr;
+  MemoryManager *memory = nullptr;
+  DnsCache *dns = nullptr;
+  CURLM *multi_handle = nullptr;
+  std::unique_ptr<std::thread> worker;
+
+  // idle easy handles, the least recently used one in front
+  struct IdleHandle {
+    CURL *curl;
+    steady_clock::time_point since;
+  };
+  std::deque<IdleHandle> handles;
+  int max_handles;
+  int max_handles_per_host;
+  size_t min_idle_handles;
+  steady_clock::duration handle_idle_timeout;
+  // Config::state_dir only, frees handles off the worker thread
+  HandleReaper *reaper = nullptr;
+  // a transfer ran since the last flush, see trim_handles
+  bool state_dirty = false;
+  steady_clock::duration state_flush_interval;
+  steady_clock::time_point next_state_flush;
+  // per host state, see host_hash
+  std::unordered_map<uint64_t, HostState> hosts;
+  bool adaptive;
+  int adaptive_min;
+  int adaptive_max;
+  // submissions from any thread, drained by the worker into the scheduler
+  MpscRing<TaskData *> submissions{4096};
+  // ids of requests to cancel, from any thread
+  MpscRing<uint64_t> cancellations{256};
+  // ids of requests whose paused upload got more data, from any thread
+  MpscRing<uint64_t> resumptions{256};
+  // queued and running requests by id, only touched by the worker thread
+  std::unordered_map<uint64_t, TaskData *> tasks_by_id;
+  // set once a wakeup is in flight, so a burst costs a single wakeup
+  std::atomic<bool> wakeup_pending = false;
+  // only touched by the worker thread
+  Scheduler scheduler;
+  TimerWheel timers;
+
+  // queue wait of started requests per priority, written by the worker
+  struct WaitStats {
+    std::atomic<uint64_t> started = 0;
+    std::atomic<uint64_t> total_wait_us = 0;
+    std::atomic<uint64_t> max_wait_us = 0;
+    std::atomic<int> pending = 0;
+  } wait_stats[priority_count];
+  int total_handle = 0;
+  std::atomic<bool> should_exit = false;
+  // whether a worker thread runs, guarded by start_mutex when set
+  std::atomic<bool> running = false;
+  std::mutex start_mutex;
+  steady_clock::duration worker_idle_timeout;
+  size_t body_coalesce_bytes;
+  steady_clock::duration body_coalesce_delay;
+  // only touched by the worker thread
+  steady_clock::time_point idle_since;
+  // set by flucurl_session_shutdown, the worker exits once drained
+  std::atomic<bool> closing = false;
+  steady_clock::time_point close_deadline;
+  int running_handles = 0;
+
+  enum DeliveryMode delivery_mode = DELIVERY_CALLBACK;
+  // DELIVERY_PORT only, from Config
+  DartPostCObject post_cobject = nullptr;
+  int64_t event_port = 0;
+
+  // DELIVERY_RING only, events of this shard's requests for
+  // flucurl_session_poll_events. Events that do not fit wait in the backlog
+  // until the consumer made room.
+  SpscRing<Event> events{1024};
+  std::deque<Event> event_backlog;
+  bool events_unpublished = false;
+  std::atomic<bool> backlog_waiting = false;
+
+  // socket action modes only, the loop driving the multi handle
+  EventLoop *loop = nullptr;
+#ifdef FLUCURL_USE_EPOLL
+  // the private loop of LOOP_SOCKET_ACTION
+  std::unique_ptr<EventLoop> owned_loop;
+#endif
+  // whether the loop adopted the shard, only written by the loop thread
+  std::atomic<bool> attached = false;
+  // deadline requested by curl through CURLMOPT_TIMERFUNCTION
+  bool timer_armed = false;
+  steady_clock::time_point timer_deadline;
+
+  Shard(Session *session, const Config &config, int index, int shard_count);
+
+  ~Shard() {
+    curl_multi_cleanup(multi_handle);
+    for (auto handle : handles) {
+      free_handle(handle.curl);
+    }
+    Event event;
+    while (events.try_pop(event)) {
+      free_event(event);
+    }
+    for (auto &event : event_backlog) {
+      free_event(event);
+    }
+  }
+
+  // wake the worker up, safe to call from any thread
+  void wakeup() {
+#ifdef FLUCURL_USE_EPOLL
+    if (loop) {
+      loop->wakeup();
+      return;
+    }
+#endif
+    curl_multi_wakeup(multi_handle);
+  }
+
+  // safe to call from any thread
+  // the worker is started lazily and exits when parked, see try_park
+  void ensure_running() {
+    if (running) {
+      return;
+    }
+    std::lock_guard lock(start_mutex);
+    if (running) {
+      return;
+    }
+    if (worker) {
+      // a parked worker that already decided to exit
+      worker->join();
+    }
+    running = true;
+    idle_since = steady_clock::now();
+#ifdef FLUCURL_USE_EPOLL
+    if (loop) {
+      loop->attach(this);
+      return;
+    }
+#endif
+    worker = std::make_unique<std::thread>(session_worker_func, this);
+  }
+
+  void stop() {
+    std::lock_guard lock(start_mutex);
+    should_exit = true;
+#ifdef FLUCURL_USE_EPOLL
+    if (loop) {
+      if (running) {
+        loop->detach(this);
+      }
+      running = false;
+      return;
+    }
+#endif
+    wakeup();
+    if (worker) {
+      worker->join();
+      worker = nullptr;
+    }
+    running = false;
+  }
+
+  // safe to call from any thread
+  // false once the shard is closing, the task is left to the caller
+  bool add_task(TaskData *task) {
+    if (closing) {
+      return false;
+    }
+    while (!submissions.try_push(task)) {
+      if (closing) {
+        // the worker may have exited and never make room
+        return false;
+      }
+      // the ring is full, make sure the worker is draining it
+      ensure_running();
+      wakeup();
+      std::this_thread::yield();
+    }
+    if (!wakeup_pending.exchange(true)) {
+      wakeup();
+    }
+    // after publishing wakeup_pending, see try_park
+    ensure_running();
+    return true;
+  }
+
+  // safe to call from any thread
+  void start_closing(steady_clock::time_point deadline) {
+    close_deadline = deadline;
+    closing = true;
+    // a parked worker has to run to report the shard closed
+    ensure_running();
+    wakeup();
+  }
+
+  // safe to call from any thread
+  void cancel_task(uint64_t id) {
+    while (!cancellations.try_push(id)) {
+      if (!running) {
+        // parked workers have no requests left to cancel
+        return;
+      }
+      wakeup();
+      std::this_thread::yield();
+    }
+    if (!wakeup_pending.exchange(true)) {
+      wakeup();
+    }
+  }
+  // safe to call from any thread
+  void resume_upload(uint64_t id) {
+    while (!resumptions.try_push(id)) {
+      if (!running) {
+        // parked workers have no uploads left
+        return;
+      }
+      wakeup();
+      std::this_thread::yield();
+    }
+    if (!wakeup_pending.exchange(true)) {
+      wakeup();
+    }
+  }
+
+
+  // only called by worker thread
+  void drain_task_queue() {
+    // clear the flag before draining, anything pushed after this point
+    // either gets drained below or triggers a new wakeup
+    wakeup_pending.store(false);
+    TaskData *submitted;
+    while (submissions.try_pop(submitted)) {
+      tasks_by_id[submitted->id] = submitted;
+      schedule_deadlines(submitted);
+      scheduler.push(submitted);
+    }
+    uint64_t cancelled;
+    while (cancellations.try_pop(cancelled)) {
+      cancel_request(cancelled, "Request cancelled");
+    }
+    uint64_t resumed;
+    while (resumptions.try_pop(resumed)) {
+      auto it = tasks_by_id.find(resumed);
+      if (it != tasks_by_id.end() && it->second->curl) {
+        curl_easy_pause(it->second->curl, CURLPAUSE_CONT);
+      }
+    }
+    // drop requests whose deadline passed before they get a handle
+    expire_timers();
+    auto can_start = [this](uint64_t host) { return host_can_start(host); };
+    while (!scheduler.empty() && can_acquire_handle()) {
+      TaskData *task = scheduler.pop(can_start);
+      if (!task) {
+        // every pending host is at its limit
+        break;
+      }
+      record_wait(task);
+      perform_request(acquire_handle(), task);
+    }
+    trim_handles();
+    prune_hosts();
+    for (int i = 0; i < priority_count; i++) {
+      wait_stats[i].pending.store(scheduler.size(i),
+                                  std::memory_order_relaxed);
+    }
+  }
+
+  // only called by worker thread
+  // whether the worker has been idle for worker_idle_timeout and exits, the
+  // multi handle and its connection cache stay for the next start
+  bool try_park() {
+    if (worker_idle_timeout == steady_clock::duration::zero() || closing) {
+      return false;
+    }
+    auto now = steady_clock::now();
+    if (!tasks_by_id.empty() || !event_backlog.empty()) {
+      idle_since = now;
+      return false;
+    }
+    if (now - idle_since < worker_idle_timeout) {
+      return false;
+    }
+    std::lock_guard lock(start_mutex);
+    // submitters set wakeup_pending or closing before they check running,
+    // so either they see the worker gone or it sees their work
+    running = false;
+    if (wakeup_pending || closing) {
+      running = true;
+      return false;
+    }
+    return true;
+  }
+
+  // only called by worker thread
+  // whether a closing shard is done: all accepted requests finished, or the
+  // drain budget is spent and the rest got cancelled
+  bool drained() {
+    if (!closing) {
+      return false;
+    }
+    if (steady_clock::now() >= close_deadline) {
+      std::vector<uint64_t> ids;
+      for (auto &[id, task] : tasks_by_id) {
+        ids.push_back(id);
+      }
+      for (auto id : ids) {
+        cancel_request(id, "Session is shut down");
+      }
+      publish_events();
+    }
+    return tasks_by_id.empty() && !wakeup_pending;
+  }
+
+  // only called once the worker has exited
+  void reject_submissions(const char *message) {
+    TaskData *task;
+    while (submissions.try_pop(task)) {
+      deliver_error(task, message);
+      release_task(task);
+    }
+  }
+
+  // only called by worker thread
+  void schedule_deadlines(TaskData *task) {
+    auto &request = task->request;
+    if (request.timeout_ms > 0) {
+      task->deadline_timer.data = task;
+      timers.schedule(&task->deadline_timer,
+                      task->enqueued_at + milliseconds(request.timeout_ms));
+    }
+    if (request.first_byte_timeout_ms > 0) {
+      task->first_byte_timer.data = task;
+      timers.schedule(
+          &task->first_byte_timer,
+          task->enqueued_at + milliseconds(request.first_byte_timeout_ms));
+    }
+  }
+
+  // only called by worker thread
+  void expire_timers() {
+    timers.advance(steady_clock::now(), [this](TimerWheel::Node *node) {
+      auto *task = static_cast<TaskData *>(node->data);
+      if (node == &task->deadline_timer) {
+        cancel_request(task->id, "Request deadline exceeded");
+      } else if (node == &task->flush_timer) {
+        flush_body(task);
+      } else if (!task->first_byte_received) {
+        cancel_request(task->id, "Time to first byte exceeded");
+      }
+    });
+  }
+
+  // only called by worker thread
+  // hands a body chunk to onData, or holds it back to coalesce it with the
+  // following ones, see Config::body_coalesce_bytes
+  void deliver_body(TaskData *task, const char *data, size_t size) {
+    if (body_coalesce_bytes == 0) {
+      deliver_data(task, slab_append(task->slab, memory, data, size,
+                                     task->session));
+      return;
+    }
+    if (!task->pending_body ||
+        !task->slab->extend(task->pending_body, data, size)) {
+      flush_body(task);
+      task->pending_body =
+          slab_append(task->slab, memory, data, size, task->session,
+                      body_coalesce_bytes + sizeof(BodyData));
+    }
+    if (static_cast<size_t>(task->pending_body->size) >= body_coalesce_bytes) {
+      flush_body(task);
+    } else if (!task->flush_timer.linked()) {
+      task->flush_timer.data = task;
+      timers.schedule(&task->flush_timer,
+                      steady_clock::now() + body_coalesce_delay);
+    }
+  }
+
+  // only called by worker thread, once the headers are complete
+  void deliver_response(TaskData *task) {
+    if (task->preconnect) {
+      task->response.status = 0;
+      return;
+    }
+    pack_headers(task);
+    // marks the response delivered, the callbacks get a copy
+    auto response = task->response;
+    task->response.status = 0;
+    if (delivery_mode == DELIVERY_CALLBACK) {
+      task->callback(response);
+      return;
+    }
+    if (delivery_mode == DELIVERY_PORT) {
+      // [id, EVENT_RESPONSE, status, http_version, headers, header_data]
+      DartCObject objects[] = {
+          dart_int64(task->id),
+          dart_int32(EVENT_RESPONSE),
+          dart_int32(response.status),
+          dart_int32(response.http_version),
+          dart_bytes(reinterpret_cast<const char *>(response.headers),
+                     response.header_count * sizeof(Header)),
+          dart_bytes(response.header_data, response.header_data_len)};
+      post_event(objects, std::size(objects));
+      // the block was copied into the message
+      flucurl_free_reponse(response);
+      return;
+    }
+    Event event{};
+    event.type = EVENT_RESPONSE;
+    event.request_id = task->id;
+    event.response = response;
+    push_event(event);
+  }
+
+  // only called by worker thread
+  // body_data is nullptr once the body is complete
+  void deliver_data(TaskData *task, BodyData *body_data) {
+    if (task->preconnect) {
+      if (body_data) {
+        flucurl_free_bodydata(body_data);
+      }
+      return;
+    }
+    if (delivery_mode == DELIVERY_CALLBACK) {
+      task->onData(body_data);
+      return;
+    }
+    if (delivery_mode == DELIVERY_PORT) {
+      // [id, EVENT_DATA, chunk or null]
+      DartCObject objects[] = {dart_int64(task->id), dart_int32(EVENT_DATA),
+                               body_data ? dart_body(body_data)
+                                         : DartCObject{DART_COBJECT_NULL}};
+      if (!post_event(objects, 3) && body_data) {
+        // the finalizer only runs for posted chunks
+        flucurl_free_bodydata(body_data);
+      }
+      return;
+    }
+    Event event{};
+    event.type = EVENT_DATA;
+    event.request_id = task->id;
+    event.data = body_data;
+    push_event(event);
+  }
+
+  // only called by worker thread
+  void deliver_error(TaskData *task, const char *message) {
+    if (task->preconnect) {
+      return;
+    }
+    if (delivery_mode == DELIVERY_CALLBACK) {
+      task->onError(message);
+      return;
+    }
+    if (delivery_mode == DELIVERY_PORT) {
+      // [id, EVENT_ERROR, message]
+      DartCObject objects[] = {dart_int64(task->id), dart_int32(EVENT_ERROR),
+                               {DART_COBJECT_STRING}};
+      objects[2].value.as_string = message;
+      post_event(objects, 3);
+      return;
+    }
+    Event event{};
+    event.type = EVENT_ERROR;
+    event.request_id = task->id;
+    event.message = message;
+    push_event(event);
+  }
+
+  // only called by worker thread
+  // posts the objects as one array, false if the port is closed
+  bool post_event(DartCObject *objects, size_t count) {
+    DartCObject *inline_values[6];
+    std::vector<DartCObject *> heap_values;
+    DartCObject **values = inline_values;
+    if (count > std::size(inline_values)) {
+      heap_values.resize(count);
+      values = heap_values.data();
+    }
+    for (size_t i = 0; i < count; i++) {
+      values[i] = &objects[i];
+    }
+    DartCObject message{DART_COBJECT_ARRAY};
+    message.value.as_array = {static_cast<intptr_t>(count), values};
+    return post_cobject(event_port, &message);
+  }
+
+  // only called by worker thread
+  void push_event(const Event &event) {
+    // the backlog goes first to keep the events of a request in order
+    if (!event_backlog.empty() || !events.try_push(event)) {
+      event_backlog.push_back(event);
+    }
+    events_unpublished = true;
+  }
+
+  // only called by worker thread, once per loop iteration
+  // moves the backlog into the ring and notifies the consumer of new events
+  void publish_events();
+
+  // only called by worker thread
+  void flush_body(TaskData *task) {
+    timers.cancel(&task->flush_timer);
+    if (task->pending_body) {
+      deliver_data(task, task->pending_body);
+      task->pending_body = nullptr;
+    }
+  }
+
+  // only called by worker thread
+  void record_wait(TaskData *task) {
+    auto &stats = wait_stats[Scheduler::priority_of(task->request)];
+    uint64_t wait = duration_cast<microseconds>(steady_clock::now() -
+                                                task->enqueued_at)
+                        .count();
+    stats.started.fetch_add(1, std::memory_order_relaxed);
+    stats.total_wait_us.fetch_add(wait, std::memory_order_relaxed);
+    if (wait > stats.max_wait_us.load(std::memory_order_relaxed)) {
+      stats.max_wait_us.store(wait, std::memory_order_relaxed);
+    }
+  }
+
+  // only called by worker thread
+  void process_messages() {
+    CURLMsg *msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(multi_handle, &msgs_left))) {
+      if (msg->msg == CURLMSG_DONE) {
+        CURL *handle = msg->easy_handle;
+        TaskData *task = nullptr;
+        curl_easy_getinfo(handle, CURLINFO_PRIVATE, &task);
+        if (!task) {
+          continue;
+        }
+        if (adaptive) {
+          sample_host(handle, task, msg->data.result);
+        }
+        std::string_view host;
+        int port;
+        if (msg->data.result == CURLE_COULDNT_RESOLVE_HOST &&
+            request_authority(task, host, port)) {
+          dns->store(host, {});
+        }
+        if (msg->data.result != CURLE_OK) {
+          report_error(task, curl_easy_strerror(msg->data.result));
+        } else {
+          report_done(task);
+        }
+        remove_request(task);
+      }
+    }
+  }
+
+  // only called by worker thread
+  // frees the upload state and returns the task to its pool
+  void release_task(TaskData *task) {
+    tasks_by_id.erase(task->id);
+    timers.cancel(&task->deadline_timer);
+    timers.cancel(&task->first_byte_timer);
+    timers.cancel(&task->flush_timer);
+    if (task->pending_body) {
+      static_cast<Slab *>(task->pending_body->slab)->release();
+    }
+    if (task->slab) {
+      // stays alive until every chunk of it has been freed
+      task->slab->release();
+    }
+    release_upload(task);
+    if (task->header_tail) {
+      // the rest belongs to the template
+      task->header_tail->next = nullptr;
+    }
+    curl_slist_free_all(task->header_list);
+    curl_url_cleanup(task->url);
+    curl_slist_free_all(task->resolve_list);
+    if (task->request_template) {
+      task->request_template->release();
+    }
+    task_pool.release(task);
+  }
+
+  // only called by worker thread, for a running request
+  void remove_request(TaskData *task) {
+    CURL *curl = task->curl;
+    hosts[task->host].in_flight--;
+    // detached first, the handle still points to the header, url and
+    // resolve lists release_task frees
+    curl_multi_remove_handle(multi_handle, curl);
+    release_task(task);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, nullptr);
+    release_handle(curl);
+    state_dirty = reaper != nullptr;
+  }
+
+  // only called by worker thread
+  // aborts a queued or running request with a final error callback,
+  // requests that already finished are ignored
+  void cancel_request(uint64_t id, const char *message) {
+    auto it = tasks_by_id.find(id);
+    if (it == tasks_by_id.end()) {
+      return;
+    }
+    TaskData *task = it->second;
+    if (task->curl) {
+      report_error(task, message);
+      remove_request(task);
+      return;
+    }
+    scheduler.remove(task);
+    deliver_error(task, message);
+    release_task(task);
+  }
+
+  // only called by worker thread
+  void report_done(TaskData *task) {
+    if (task->response.status) {
+      // a response without a body, write_callback never ran
+      deliver_response(task);
+    }
+    flush_body(task);
+    deliver_data(task, nullptr);
+  }
+
+  // only called by worker thread
+  void report_error(TaskData *task, const char *message) {
+    // the data received so far comes first
+    flush_body(task);
+    deliver_error(task, message);
+  }
+};
+
+// DNS entries and TLS sessions shared by the easy handles of a session, or
+// of every session with Config::global_share. Each kind of data has its own
+// lock, so a DNS lookup never waits for a TLS session lookup. Connections
+// are not shared: curl does not support one connection cache used by
+// several multi handles at once, and host affinity keeps a host on one
+// shard anyway, so each shard's multi handle keeps its own. Sessions hold a
+// reference.
+class ShareHandle {
+  std::mutex locks[CURL_LOCK_DATA_LAST];
+
+  // guards refs and global, sessions come and go rarely
+  static std::mutex global_mutex;
+  int refs = 1;
+  static ShareHandle *global;
+
+  static void lock(CURL *handle, curl_lock_data data, curl_lock_access access,
+                   void *userptr) {
+    static_cast<ShareHandle *>(userptr)->locks[data].lock();
+  }
+
+  static void unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    static_cast<ShareHandle *>(userptr)->locks[data].unlock();
+  }
+
+  ~ShareHandle() { curl_share_cleanup(handle); }
+
+ public:
+  CURLSH *handle;
+
+  ShareHandle() {
+    handle = curl_share_init();
+    curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(handle, CURLSHOPT_LOCKFUNC, lock);
+    curl_share_setopt(handle, CURLSHOPT_UNLOCKFUNC, unlock);
+    curl_share_setopt(handle, CURLSHOPT_USERDATA, this);
+  }
+
+  // the process wide share, created on first use and freed with the last
+  // session using it. Safe across sessions as it holds no connections.
+  static ShareHandle *acquire_global() {
+    std::lock_guard lock(global_mutex);
+    if (global) {
+      global->refs++;
+    } else {
+      global = new ShareHandle();
+    }
+    return global;
+  }
+
+  // only call this once no easy handle uses the share anymore
+  void release() {
+    std::lock_guard lock(global_mutex);
+    if (--refs == 0) {
+      if (this == global) {
+        global = nullptr;
+      }
+      delete this;
+    }
+  }
+};
+
+std::mutex ShareHandle::global_mutex;
+ShareHandle *ShareHandle::global = nullptr;
+
+class Session {
+ public:
+  Config config;
+  CURL *handle_prototype = nullptr;
+  ShareHandle *share = nullptr;
+  std::vector<std::unique_ptr<Shard>> shards;
+  // released when the session is freed, outstanding responses and chunks
+  // keep it alive beyond that
+  MemoryManager *memory = nullptr;
+  std::unique_ptr<DnsCache> dns;
+  // see Config::state_dir
+  std::unique_ptr<StateStore> state;
+  std::unique_ptr<HandleReaper> reaper;
+#ifdef FLUCURL_USE_OPENSSL
+  // see set_trusted_roots
+  std::unique_ptr<TrustedRoots> trusted_roots;
+#endif
+
+  // templates not removed yet, released with the session
+  std::mutex templates_mutex;
+  std::vector<TemplateData *> templates;
+
+  // request ids carry the shard index in their low bits
+  static constexpr int shard_bits = 6;
+  std::atomic<uint64_t> next_id = 1;
+
+  // see flucurl_session_shutdown
+  std::atomic<bool> closing = false;
+  // threads inside the session API, the session outlives all of them. Once
+  // closing, the draining bit is set too, so the caller that leaves last
+  // learns it from its own decrement and wakes the teardown.
+  std::atomic<int> callers = 0;
+  static constexpr int draining = 1 << 30;
+  // shared by all sessions, leaving callers must not touch a session that
+  // may be freed as soon as they are out
+  static std::mutex teardown_mutex;
+  static std::condition_variable teardown_cv;
+  std::atomic<int> open_shards = 0;
+  ShutdownCallback on_shutdown = nullptr;
+  // set once the consumer was told about new events, see poll_events
+  std::atomic<bool> events_notified = false;
+
+  UploadState *add_request(Request request, ResponseCallback callback,
+                           DataHandler onData, ErrorHandler onError,
+                           uint64_t &request_id, bool preconnect = false) {
+    auto reject = [&] {
+      leave();
+      request_id = 0;
+      // ring and port delivery report nothing from this thread, the null
+      // result says it all
+      if (config.delivery_mode == DELIVERY_CALLBACK && !preconnect) {
+        onError("Session is shut down");
+      }
+      return nullptr;
+    };
+    callers++;
+    if (closing) {
+      return reject();
+    }
+    auto *task = task_pool.acquire();
+    task->session = this;
+    task->onData = onData;
+    task->onError = onError;
+    task->callback = callback;
+    task->request = request;
+    if (preconnect) {
+      task->preconnect = true;
+      task->preconnect_url = request.url;
+      task->request.url = task->preconnect_url.c_str();
+    }
+    auto *request_template =
+        static_cast<TemplateData *>(request.request_template);
+    if (request_template) {
+      request_template->retain();
+      task->request_template = request_template;
+    }
+    // a template's url may be replaced by an absolute one, a request
+    // without any url fails on its worker
+    task->host = request_template && (!request.url ||
+                                      !std::strstr(request.url, "://"))
+                     ? request_template->host
+                 : request.url ? host_hash(request.url)
+                               : 0;
+    task->enqueued_at = steady_clock::now();
+    uint64_t shard = task->host % shards.size();
+    task->id = next_id.fetch_add(1, std::memory_order_relaxed) << shard_bits |
+               shard;
+    request_id = task->id;
+    task->shard = shards[shard].get();
+    if (request.content_length > 0) {
+      task->has_body = true;
+      std::lock_guard lock(task->upload_mutex);
+      task->upload_state.session = this;
+      task->upload_state.request_id = task->id;
+    }
+    if (!task->shard->add_task(task)) {
+      // the shard started closing meanwhile
+      release_upload(task);
+      if (request_template) {
+        request_template->release();
+      }
+      task_pool.release(task);
+      return reject();
+    }
+    leave();
+    return &task->upload_state;
+  }
+
+  // Curl does not reuse connections of CURLOPT_CONNECT_ONLY handles, so the
+  // connections are opened by HEAD requests that deliver nothing.
+  void preconnect(const char *url, int count) {
+    Request request{};
+    request.url = url;
+    request.method = "HEAD";
+    request.priority = PRIORITY_LOW;
+    for (int i = 0; i < count; i++) {
+      uint64_t request_id;
+      add_request(request, nullptr, nullptr, nullptr, request_id, true);
+    }
+  }
+
+  void shutdown(int drain_ms, ShutdownCallback callback) {
+    if (closing.exchange(true)) {
+      return;
+    }
+    // the first shards may close before the last one is told to
+    callers.fetch_or(draining);
+    callers++;
+    on_shutdown = callback;
+    open_shards = static_cast<int>(shards.size());
+    auto deadline = steady_clock::now() + milliseconds(std::max(drain_ms, 0));
+    for (auto &shard : shards) {
+      shard->start_closing(deadline);
+    }
+    leave();
+  }
 
-void session_worker_func(Session *session);
+  // called by each worker of a closing session once it is drained, the last
+  // one tears the session down on its own thread
+  void shard_closed(Shard *closed) {
+    if (open_shards.fetch_sub(1) != 1) {
+      return;
+    }
+    {
+      std::unique_lock lock(teardown_mutex);
+      teardown_cv.wait(lock, [this] { return callers == draining; });
+    }
+    for (auto &shard : shards) {
+      // event loop shards have no worker, a private loop is joined when the
+      // shard is freed
+      if (shard->worker) {
+        if (shard.get() == closed) {
+          shard->worker->detach();
+        } else {
+          shard->worker->join();
+        }
+        shard->worker = nullptr;
+      }
+      // requests that raced with the shutdown
+      shard->reject_submissions("Session is shut down");
+    }
+    auto callback = on_shutdown;
+    session_cleanup(this);
+    if (callback) {
+      callback();
+    }
+  }
 
-template <typename T>
-class ObjectPool {
-  std::vector<T *> items;
-  std::mutex mtx;
-  uint32_t max_size;
+  // safe to call from any thread
+  void notify_events() {
+    if (!events_notified.exchange(true) && config.event_notify) {
+      config.event_notify();
+    }
+  }
 
- public:
-  T *acquire_item() {
-    std::unique_lock lk{mtx};
-    if (items.empty()) {
-      return new T();
+  // only one thread at a time
+  int poll_events(Event *out, int max_events) {
+    callers++;
+    if (closing && open_shards == 0) {
+      leave();
+      return 0;
+    }
+    // cleared first, so events published while draining notify again
+    events_notified = false;
+    int count = 0;
+    for (auto &shard : shards) {
+      while (count < max_events && shard->events.try_pop(out[count])) {
+        count++;
+      }
+      if (shard->backlog_waiting) {
+        // the worker moves its backlog into the room made
+        shard->wakeup();
+      }
     }
-    T *item = items.back();
-    items.pop_back();
-    return item;
+    leave();
+    return count;
   }
-  void release_item(T *item) {
-    std::unique_lock lk{mtx};
-    if (items.size() >= max_size) {
-      delete item;
+
+  void cancel_request(uint64_t id) {
+    callers++;
+    // once every shard closed the session is being freed
+    if (closing && open_shards == 0) {
+      leave();
       return;
     }
-    *item = {};
-    items.push_back(item);
+    uint64_t shard = id & ((1 << shard_bits) - 1);
+    if (shard < shards.size()) {
+      shards[shard]->cancel_task(id);
+    }
+    leave();
   }
-  ObjectPool(int32_t max_size = 50) : max_size(max_size) {}
-  ~ObjectPool() {
-    std::unique_lock lk{mtx};
-    for (auto item : items) {
-      delete item;
+
+  // the counterpart of callers++
+  void leave() {
+    if (callers.fetch_sub(1) == draining + 1) {
+      // the session may be gone already
+      std::lock_guard lock(teardown_mutex);
+      teardown_cv.notify_all();
     }
   }
+
+  Session() {}
+
+  ~Session() {}
 };
 
-ObjectPool<BodyData> body_data_pool;
-ObjectPool<TaskData> request_task_pool;
-ObjectPool<UploadState> upload_state_pool;
-class Session {
- public:
-  // only call this in worker thread
-  // you should lock outside
-  CURL *acquire_handle() {
-    if (!handles.empty()) {
-      CURL *curl = handles.back();
-      handles.pop_back();
-      return curl;
-    }
-    if (total_handle < 50) {
-      total_handle++;
-      CURL *curl = curl_easy_duphandle(handle_prototype);
-      curl_easy_setopt(curl, CURLOPT_SHARE, share_handle);
-      return curl;
+std::mutex Session::teardown_mutex;
+std::condition_variable Session::teardown_cv;
+
+void Shard::publish_events() {
+  if (delivery_mode != DELIVERY_RING) {
+    return;
+  }
+  if (!event_backlog.empty()) {
+    // set before pushing, a consumer that makes room after a failed push
+    // sees it and wakes the worker
+    backlog_waiting = true;
+    while (!event_backlog.empty() &&
+           events.try_push(event_backlog.front())) {
+      event_backlog.pop_front();
+      events_unpublished = true;
     }
-    return nullptr;
+    backlog_waiting = !event_backlog.empty();
   }
+  if (events_unpublished) {
+    events_unpublished = false;
+    session->notify_events();
+  }
+}
 
-  // only call this in worker thread
-  // you should lock outside
-  void release_handle(CURL *curl) {
-    // when there is too many idle handles
-    handles.push_back(curl);
+CURL *Shard::acquire_handle() {
+  if (!handles.empty()) {
+    // the most recently used handle, the old ones get trimmed
+    CURL *curl = handles.back().curl;
+    handles.pop_back();
+    return curl;
+  }
+  if (total_handle < max_handles) {
+    total_handle++;
+    CURL *curl = reaper ? reaper->take() : nullptr;
+    if (!curl) {
+      // past the spares of a state_dir a handle starts without the saved
+      // Alt-Svc entries rather than reading them here
+      curl = curl_easy_duphandle(session->handle_prototype);
+    }
+    curl_easy_setopt(curl, CURLOPT_SHARE, session->share->handle);
+    return curl;
   }
+  return nullptr;
+}
 
-  // only call this in worker thread
-  void perform_request(CURL *curl, TaskData *task) {
-    UploadState *state = task->upload_state;
-    Request request = task->request;
-    curl_easy_setopt(curl, CURLOPT_READDATA, state);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, request.content_length);
+#ifdef FLUCURL_USE_EPOLL
+EventLoop::EventLoop(bool shared) : shared(shared) {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = wakeup_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev);
+}
 
-    // set header receive callback
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, task);
+EventLoop::~EventLoop() {
+  if (thread) {
+    // a private loop is freed by its own thread when its session shuts down
+    if (thread->get_id() == std::this_thread::get_id()) {
+      thread->detach();
+    } else {
+      thread->join();
+    }
+  }
+  close(epoll_fd);
+  close(wakeup_fd);
+}
 
-    // set body receive callback
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, task);
+void EventLoop::attach(Shard *shard) {
+  std::lock_guard lock(mtx);
+  attaching.push_back(shard);
+  if (!running) {
+    if (thread) {
+      // the previous thread already decided to exit
+      thread->join();
+    }
+    running = true;
+    thread = std::make_unique<std::thread>(&EventLoop::run, this);
+  }
+  wakeup();
+}
 
-    // set http method
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.method);
+void EventLoop::detach(Shard *shard) {
+  std::unique_lock lock(mtx);
+  if (!running) {
+    return;
+  }
+  detaching.push_back(shard);
+  wakeup();
+  detached.wait(lock, [&] {
+    return std::find(detaching.begin(), detaching.end(), shard) ==
+           detaching.end();
+  });
+}
 
-    // set http headers
-    curl_slist *list = nullptr;
-    for (int i = 0; i < request.header_count; i++) {
-      list = curl_slist_append(list, request.headers[i]);
+// only called by the loop thread, forgets the shard and its sockets
+void EventLoop::release(Shard *shard) {
+  std::erase_if(sockets, [&](auto &entry) {
+    if (entry.second != shard) {
+      return false;
     }
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, entry.first, nullptr);
+    return true;
+  });
+  shard->attached = false;
+}
 
-    CURLcode ret = curl_easy_setopt(curl, CURLOPT_URL, request.url);
-    if (ret != CURLE_OK) {
-      task->onError("Unable to set URL");
-      return;
-    }
-    requests[curl] = task;
+int loop_pool_size = 1;
+std::vector<EventLoop *> loop_pool;
+size_t next_pool_loop = 0;
+std::mutex loop_pool_mutex;
 
-    curl_multi_add_handle(multi_handle, curl);
+// the loops live as long as the process
+EventLoop *shared_event_loop() {
+  std::lock_guard lock(loop_pool_mutex);
+  if (loop_pool.empty()) {
+    for (int i = 0; i < loop_pool_size; i++) {
+      loop_pool.push_back(new EventLoop(true));
+    }
   }
+  return loop_pool[next_pool_loop++ % loop_pool.size()];
+}
+#endif
 
-  std::unordered_map<CURL *, TaskData *> requests;
-  std::mutex task_queue_mtx{};
-  CURLM *multi_handle = nullptr;
-  CURLSH *share_handle = nullptr;
-  std::vector<CURL *> handles;
-  std::unique_ptr<std::thread> worker;
-  std::queue<TaskData *> task_queue;
-  int total_handle = 0;
-  bool should_exit = false;
-  int running_handles = 0;
-  Config config;
-  CURL *handle_prototype;
+Shard::Shard(Session *session, const Config &config, int index,
+             int shard_count)
+    : session(session),
+      memory(session->memory),
+      dns(session->dns.get()),
+      reaper(session->reaper.get()) {
+  // the session wide limit is split between shards, the first ones take
+  // the remainder so the shares add up to it
+  int total = config.max_handles > 0 ? config.max_handles : 50;
+  max_handles = total / shard_count + (index < total % shard_count ? 1 : 0);
+  max_handles_per_host = std::max(config.max_handles_per_host, 0);
+  min_idle_handles = std::max(config.min_idle_handles, 0);
+  handle_idle_timeout = seconds(
+      config.handle_idle_timeout > 0 ? config.handle_idle_timeout : 30);
+  state_flush_interval = seconds(
+      config.state_flush_interval > 0 ? config.state_flush_interval : 60);
+  next_state_flush = steady_clock::now() + state_flush_interval;
+  adaptive = config.adaptive_concurrency;
+  adaptive_min = std::max(config.adaptive_min_limit, 1);
+  adaptive_max = config.adaptive_max_limit > 0 ? config.adaptive_max_limit
+                                               : max_handles;
+  adaptive_max = std::max(adaptive_max, adaptive_min);
+  worker_idle_timeout = seconds(std::max(config.worker_idle_timeout, 0));
+  delivery_mode = config.delivery_mode;
+  post_cobject = reinterpret_cast<DartPostCObject>(config.post_cobject);
+  event_port = config.event_port;
+  body_coalesce_bytes = std::max(config.body_coalesce_bytes, 0);
+  body_coalesce_delay = milliseconds(
+      config.body_coalesce_delay_ms > 0 ? config.body_coalesce_delay_ms : 5);
 
-  UploadState *add_request(Request request, ResponseCallback callback,
-                           DataHandler onData, ErrorHandler onError) {
-    auto *task = request_task_pool.acquire_item();
-    task->session = this;
-    task->onData = onData;
-    task->onError = onError;
-    task->callback = callback;
-    task->request = request;
-    task->response = {};
-    task->response.session = this;
+  multi_handle = curl_multi_init();
+  // enable HTTP2 multiplexing by default
+  curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  // keep as many connections around as we may run transfers
+  curl_multi_setopt(multi_handle, CURLMOPT_MAXCONNECTS,
+                    static_cast<long>(max_handles));
+  if (max_handles_per_host) {
+    curl_multi_setopt(multi_handle, CURLMOPT_MAX_HOST_CONNECTIONS,
+                      static_cast<long>(max_handles_per_host));
+  }
 
-    // set http body
-    auto *state = upload_state_pool.acquire_item();
-    state->queue = new std::queue<Field>();
-    state->mtx = new std::mutex();
-    state->session = this;
-    task->upload_state = state;
+#ifdef FLUCURL_USE_EPOLL
+  if (config.loop_mode == LOOP_SOCKET_ACTION) {
+    owned_loop = std::make_unique<EventLoop>(false);
+    loop = owned_loop.get();
+  } else if (config.loop_mode == LOOP_SHARED) {
+    loop = shared_event_loop();
+  }
+  if (loop) {
+    curl_multi_setopt(multi_handle, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(multi_handle, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi_handle, CURLMOPT_TIMERFUNCTION, timer_callback);
+    curl_multi_setopt(multi_handle, CURLMOPT_TIMERDATA, this);
+  }
+#endif
+}
 
-    {
-      std::unique_lock lk{task_queue_mtx};
-      task_queue.push(task);
-      curl_multi_wakeup(multi_handle);
+#ifdef FLUCURL_USE_OPENSSL
+// Root certificates of Config::tls_config, parsed once per session. Curl
+// parses a CA blob again for every connection, this store is handed to each
+// new TLS context instead and only gains a reference there.
+class TrustedRoots {
+ public:
+  explicit TrustedRoots(const std::string &bundle) : store(X509_STORE_new()) {
+    BIO *bio = BIO_new_mem_buf(bundle.data(), static_cast<int>(bundle.size()));
+    while (X509 *certificate =
+               PEM_read_bio_X509(bio, nullptr, nullptr, nullptr)) {
+      X509_STORE_add_cert(store, certificate);
+      X509_free(certificate);
     }
-    return state;
+    BIO_free(bio);
+    // the end of the input is queued as an error, curl must not see it
+    ERR_clear_error();
   }
+  ~TrustedRoots() { X509_STORE_free(store); }
 
-  // only called by worker thread
-  void remove_request(CURL *curl) {
-    auto it = requests.find(curl);
-    if (it != requests.end()) {
-      auto mtx = static_cast<std::mutex *>(it->second->upload_state->mtx);
-      delete mtx;
-      auto queue =
-          static_cast<std::queue<Field> *>(it->second->upload_state->queue);
-      delete queue;
-      delete it->second->upload_state;
-      request_task_pool.release_item(it->second);
-      requests.erase(it);
-      curl_multi_remove_handle(multi_handle, curl);
-      release_handle(curl);
+  // The context callback hands over OpenSSL types only with an OpenSSL
+  // compatible backend, linking OpenSSL says nothing about the backend of
+  // the curl that is linked.
+  static bool supported() {
+    const char *backend = curl_version_info(CURLVERSION_NOW)->ssl_version;
+    if (!backend) {
+      return false;
+    }
+    std::string_view name = backend;
+    for (std::string_view prefix :
+         {"OpenSSL/", "BoringSSL", "quictls/", "LibreSSL/", "AWS-LC/"}) {
+      if (name.starts_with(prefix)) {
+        return true;
+      }
     }
+    return false;
   }
 
-  Session() {}
+  void apply(CURL *curl) {
+    // nothing else is loaded only to be replaced by the store
+    curl_easy_setopt(curl, CURLOPT_CAINFO, nullptr);
+    curl_easy_setopt(curl, CURLOPT_CAPATH, nullptr);
+    curl_easy_setopt(curl, CURLOPT_SSL_OPTIONS, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, ssl_ctx_callback);
+    curl_easy_setopt(curl, CURLOPT_SSL_CTX_DATA, this);
+  }
 
-  ~Session() {}
+ private:
+  X509_STORE *store;
 
-  // only called by worker thread
-  void report_done(CURL *curl) {
-    auto it = requests.find(curl);
-    if (it != requests.end()) {
-      it->second->onData(nullptr);
-    }
+  static CURLcode ssl_ctx_callback(CURL *, void *ssl_ctx, void *userp) {
+    auto *roots = static_cast<TrustedRoots *>(userp);
+    SSL_CTX_set1_cert_store(static_cast<SSL_CTX *>(ssl_ctx), roots->store);
+    return CURLE_OK;
   }
+};
+#endif
 
-  // only called by worker thread
-  void report_error(CURL *curl, const char *message) {
-    auto it = requests.find(curl);
-    if (it != requests.end()) {
-      it->second->onError(message);
+// Sets the trusted roots of Config::tls_config on the prototype.
+void set_trusted_roots(Session *session, CURL *curl) {
+  auto *tls = session->config.tls_config;
+  std::string bundle;
+  for (int i = 0; i < tls->trusted_root_certificates_length; i++) {
+    if (const char *certificate = tls->trusted_root_certificates[i]) {
+      bundle += certificate;
+      if (!bundle.empty() && bundle.back() != '\n') {
+        bundle += '\n';
+      }
     }
   }
-};
+#ifdef FLUCURL_USE_OPENSSL
+  if (TrustedRoots::supported()) {
+    session->trusted_roots = std::make_unique<TrustedRoots>(bundle);
+    session->trusted_roots->apply(curl);
+    return;
+  }
+#endif
+  // other backends parse the blob for every connection
+  curl_blob blob{bundle.data(), bundle.size(), CURL_BLOB_COPY};
+  curl_easy_setopt(curl, CURLOPT_CAINFO_BLOB, &blob);
+}
 
 auto flucurl_session_init(Config config) -> void * {
   auto *session = new Session();
   session->config = config;
+  session->memory = new MemoryManager(
+      config.memory_cache_limit > 0 ? config.memory_cache_limit
+                                    : 4 * 1024 * 1024);
+  task_pool.attach(config.max_handles > 0 ? config.max_handles : 50);
+  int dns_timeout = config.dns_cache_timeout > 0 ? config.dns_cache_timeout
+                                                 : 60;
+  session->dns = std::make_unique<DnsCache>(
+      seconds(dns_timeout),
+      config.dns_negative_timeout < 0 ? seconds(-1)
+      : config.dns_negative_timeout > 0
+          ? seconds(config.dns_negative_timeout)
+          : seconds(5));
   CURL *curl = curl_easy_init();
-  // set default ssl support
+  // set default ssl support. The native store is only read on Windows and
+  // Apple platforms, elsewhere the flag just keeps curl from caching the
+  // parsed default CA file
+#if defined(_WIN32) || defined(__APPLE__)
   curl_easy_setopt(curl, CURLOPT_SSL_OPTIONS, CURLSSLOPT_NATIVE_CA);
+#endif
   curl_easy_setopt(curl, CURLOPT_SSLENGINE, "dynamic");
   curl_easy_setopt(curl, CURLOPT_SSLENGINE_DEFAULT, 1l);
 
+  // set tls config. Curl sends SNI for every host name and has no switch
+  // to leave it out, so enable_sni is not applied.
+  if (auto *tls = config.tls_config; tls && tls->enable) {
+    long verify = tls->verify_certificates ? 1L : 0L;
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, verify);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, verify ? 2L : 0L);
+    if (tls->trusted_root_certificates_length > 0 &&
+        tls->trusted_root_certificates) {
+      set_trusted_roots(session, curl);
+    }
+  }
+
   curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
 
-  curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, 10L);
+  curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT,
+                   static_cast<long>(dns_timeout));
+
+  // the connection cache follows the concurrency limit
+  curl_easy_setopt(
+      curl, CURLOPT_MAXCONNECTS,
+      static_cast<long>(config.max_handles > 0 ? config.max_handles : 50));
 
   curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback);
   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
@@ -284,87 +3390,373 @@ auto flucurl_session_init(Config config) -> void * {
   }
   session->handle_prototype = curl;
 
-  // set share handle, share data connections and dns cache
-  CURLSH *share_handle = curl_share_init();
-  curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
-  curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
-  session->share_handle = share_handle;
+  // load Alt-Svc and HSTS state, handles report theirs when they are freed
+  if (config.state_dir && *config.state_dir) {
+    session->state = std::make_unique<StateStore>(config.state_dir);
+    session->state->configure(curl);
+    session->reaper = std::make_unique<HandleReaper>(
+        *session->state, curl,
+        seconds(config.state_flush_interval > 0 ? config.state_flush_interval
+                                                : 60));
+  }
 
-  CURLM *multi_handle = curl_multi_init();
-  // enable HTTP2 multiplexing by default
-  curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
-  session->multi_handle = multi_handle;
+  // set share handle, share dns cache and tls sessions
+  session->share = config.global_share ? ShareHandle::acquire_global()
+                                       : new ShareHandle();
 
-  session->worker = std::make_unique<std::thread>(session_worker_func, session);
+  // every shard needs at least one handle of the limit
+  int shard_count = std::clamp(
+      config.worker_count, 1,
+      std::min(1 << Session::shard_bits,
+               config.max_handles > 0 ? config.max_handles : 50));
+  for (int i = 0; i < shard_count; i++) {
+    session->shards.push_back(
+        std::make_unique<Shard>(session, config, i, shard_count));
+  }
+  // workers start with the first request
   return session;
 }
 
-void session_worker_func(Session *session) {
-  do {
-    {
-      std::unique_lock lk{session->task_queue_mtx};
-      while (!session->task_queue.empty()) {
-        auto task = session->task_queue.front();
-        if (CURL *curl = session->acquire_handle()) {
-          session->task_queue.pop();
-          session->perform_request(curl, task);
-        } else {
-          break;
-        }
-      }
-    }
+// runs until the worker is stopped, parks or its closing shard is drained,
+// true for the last
+bool session_poll_loop(Shard *shard) {
+  while (true) {
+    shard->drain_task_queue();
     CURLMcode mc =
-        curl_multi_perform(session->multi_handle, &session->running_handles);
+        curl_multi_perform(shard->multi_handle, &shard->running_handles);
     if (mc != CURLM_OK) {
       std::cout << "Multi error: " << curl_multi_strerror(mc) << std::endl;
       std::exit(1);
     }
     // Check if there are completed messages
-    CURLMsg *msg;
-    int msgs_left;
-    while ((msg = curl_multi_info_read(session->multi_handle, &msgs_left))) {
-      if (msg->msg == CURLMSG_DONE) {
-        CURL *handle = msg->easy_handle;
-        if (msg->data.result != CURLE_OK) {
-          session->report_error(handle, curl_easy_strerror(msg->data.result));
-        } else {
-          session->report_done(handle);
-        }
-        session->remove_request(handle);
-      }
+    shard->process_messages();
+    shard->publish_events();
+    // wake up in time for the next timer, at least every 10 ms for curl
+    int wait_ms = 10;
+    steady_clock::time_point deadline;
+    if (shard->next_deadline(deadline)) {
+      auto remaining = ceil<milliseconds>(deadline - steady_clock::now());
+      wait_ms = std::clamp<long long>(remaining.count(), 0, 10);
     }
-    mc = curl_multi_poll(session->multi_handle, nullptr, 0, 10, nullptr);
+    mc = curl_multi_poll(shard->multi_handle, nullptr, 0, wait_ms, nullptr);
     if (mc != CURLM_OK) {
       std::cerr << "curl_multi_poll error: " << curl_multi_strerror(mc)
                 << std::endl;
-      break;
+      return false;
+    }
+    if (shard->should_exit) {
+      return false;
+    }
+    if (shard->drained()) {
+      return true;
+    }
+    if (shard->try_park()) {
+      return false;
+    }
+  }
+}
+
+#ifdef FLUCURL_USE_EPOLL
+int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp,
+                    void *socketp) {
+  auto *shard = static_cast<Shard *>(userp);
+  if (!shard->attached) {
+    // the multi handle is cleaned up after the loop released the shard
+    return 0;
+  }
+  auto *loop = shard->loop;
+  if (what == CURL_POLL_REMOVE) {
+    // the socket may already be closed, in which case epoll dropped it
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s, nullptr);
+    loop->sockets.erase(s);
+    return 0;
+  }
+  epoll_event ev{};
+  ev.data.fd = s;
+  if (what & CURL_POLL_IN) {
+    ev.events |= EPOLLIN;
+  }
+  if (what & CURL_POLL_OUT) {
+    ev.events |= EPOLLOUT;
+  }
+  // not curl_multi_assign, a parked shard loses its registrations
+  auto [it, added] = loop->sockets.try_emplace(s, shard);
+  epoll_ctl(loop->epoll_fd, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, s, &ev);
+  return 0;
+}
+
+int timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+  auto *shard = static_cast<Shard *>(userp);
+  if (timeout_ms < 0) {
+    shard->timer_armed = false;
+  } else {
+    shard->timer_armed = true;
+    shard->timer_deadline = steady_clock::now() + milliseconds(timeout_ms);
+  }
+  return 0;
+}
+
+void EventLoop::run() {
+  constexpr int max_events = 64;
+  epoll_event events[max_events];
+  while (true) {
+    {
+      std::lock_guard lock(mtx);
+      for (auto *shard : attaching) {
+        shard->attached = true;
+        shards.push_back(shard);
+      }
+      attaching.clear();
+      if (!detaching.empty()) {
+        for (auto *shard : detaching) {
+          release(shard);
+          std::erase(shards, shard);
+        }
+        detaching.clear();
+        detached.notify_all();
+      }
+      if (shards.empty()) {
+        running = false;
+        return;
+      }
+    }
+
+    steady_clock::time_point deadline;
+    bool has_deadline = false;
+    for (auto *shard : shards) {
+      shard->drain_task_queue();
+      steady_clock::time_point next;
+      if (shard->next_deadline(next) && (!has_deadline || next < deadline)) {
+        deadline = next;
+        has_deadline = true;
+      }
+    }
+    int wait_ms = -1;
+    if (has_deadline) {
+      auto remaining = ceil<milliseconds>(deadline - steady_clock::now());
+      wait_ms = std::max<long long>(remaining.count(), 0);
+    }
+    int n = epoll_wait(epoll_fd, events, max_events, wait_ms);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "epoll_wait error: " << std::strerror(errno) << std::endl;
+      std::exit(1);
+    }
+
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == wakeup_fd) {
+        uint64_t value;
+        [[maybe_unused]] auto r = read(fd, &value, sizeof(value));
+        continue;
+      }
+      auto it = sockets.find(fd);
+      if (it == sockets.end()) {
+        continue;
+      }
+      int flags = 0;
+      if (events[i].events & (EPOLLIN | EPOLLHUP)) {
+        flags |= CURL_CSELECT_IN;
+      }
+      if (events[i].events & EPOLLOUT) {
+        flags |= CURL_CSELECT_OUT;
+      }
+      if (events[i].events & EPOLLERR) {
+        flags |= CURL_CSELECT_ERR;
+      }
+      auto *shard = it->second;
+      curl_multi_socket_action(shard->multi_handle, fd, flags,
+                               &shard->running_handles);
     }
-  } while (!session->should_exit);
+
+    auto now = steady_clock::now();
+    std::vector<Shard *> closed;
+    std::erase_if(shards, [&](Shard *shard) {
+      if (shard->timer_armed && now >= shard->timer_deadline) {
+        shard->timer_armed = false;
+        curl_multi_socket_action(shard->multi_handle, CURL_SOCKET_TIMEOUT, 0,
+                                 &shard->running_handles);
+      }
+      shard->process_messages();
+      shard->publish_events();
+      if (shard->drained()) {
+        release(shard);
+        closed.push_back(shard);
+        return true;
+      }
+      if (shard->try_park()) {
+        release(shard);
+        return true;
+      }
+      return false;
+    });
+    if (!closed.empty()) {
+      if (!shared) {
+        // a private loop belongs to the closed shard and may be freed with
+        // it, so it must not be touched afterwards
+        {
+          std::lock_guard lock(mtx);
+          running = false;
+        }
+        closed.front()->session->shard_closed(closed.front());
+        return;
+      }
+      for (auto *shard : closed) {
+        // may free the shard and its session
+        shard->session->shard_closed(shard);
+      }
+    }
+  }
+}
+#endif
+
+// event loop shards are driven by EventLoop::run instead
+void session_worker_func(Shard *shard) {
+  // a worker that parked just before closing was set is restarted by
+  // start_closing, the restarted one reports the shard closed
+  if (session_poll_loop(shard)) {
+    // may free the shard and the session
+    shard->session->shard_closed(shard);
+  }
+}
+
+// workers must have stopped already
+void session_cleanup(Session *session) {
+  session->shards.clear();
+  // retires the last handles, then the state is saved once. The reaper
+  // copies the prototype until it stops.
+  session->reaper.reset();
+  curl_easy_cleanup(session->handle_prototype);
+  if (session->state) {
+    session->state->save();
+  }
+  for (auto *request_template : session->templates) {
+    request_template->release();
+  }
+  session->share->release();
+  session->memory->release();
+  task_pool.detach(session->config.max_handles > 0
+                       ? session->config.max_handles
+                       : 50);
+  delete session;
 }
 
 // You should only call this function when you ensure all requests has
 // completed.
 auto flucurl_session_terminate(void *p) -> void {
   auto *session = static_cast<Session *>(p);
-  session->should_exit = true;
-  curl_multi_wakeup(session->multi_handle);
-  session->worker->join();
-  session->worker = nullptr;
-  curl_multi_cleanup(session->multi_handle);
-  for (auto handle : session->handles) {
-    curl_easy_cleanup(handle);
+  for (auto &shard : session->shards) {
+    shard->stop();
   }
-  curl_easy_cleanup(session->handle_prototype);
-  curl_share_cleanup(session->share_handle);
-  delete session;
+  session_cleanup(session);
+}
+
+void flucurl_session_shutdown(void *p, int drain_ms,
+                              ShutdownCallback callback) {
+  auto *session = static_cast<Session *>(p);
+  session->shutdown(drain_ms, callback);
 }
 
 UploadState *flucurl_session_send_request(void *p, Request request,
                                           ResponseCallback callback,
                                           DataHandler onData,
-                                          ErrorHandler onError) {
+                                          ErrorHandler onError,
+                                          unsigned long long *request_id) {
+  auto *session = static_cast<Session *>(p);
+  uint64_t id;
+  auto *state = session->add_request(request, callback, onData, onError, id);
+  if (request_id) {
+    *request_id = id;
+  }
+  return state;
+}
+
+int flucurl_session_poll_events(void *p, Event *events, int max_events) {
+  auto *session = static_cast<Session *>(p);
+  return session->poll_events(events, max_events);
+}
+
+void flucurl_session_cancel_request(void *p, unsigned long long request_id) {
+  auto *session = static_cast<Session *>(p);
+  session->cancel_request(request_id);
+}
+
+QueueStats flucurl_session_queue_stats(void *p,
+                                      enum RequestPriority priority) {
+  auto *session = static_cast<Session *>(p);
+  int index = std::clamp(static_cast<int>(priority), 0, priority_count - 1);
+  QueueStats result = {};
+  for (auto &shard : session->shards) {
+    auto &stats = shard->wait_stats[index];
+    result.started += stats.started.load(std::memory_order_relaxed);
+    result.total_wait_us += stats.total_wait_us.load(std::memory_order_relaxed);
+    result.max_wait_us = std::max<unsigned long long>(
+        result.max_wait_us, stats.max_wait_us.load(std::memory_order_relaxed));
+    result.pending += stats.pending.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+MemoryStats flucurl_session_memory_stats(void *p) {
+  return static_cast<Session *>(p)->memory->stats();
+}
+
+void flucurl_session_trim_memory(void *p) {
+  static_cast<Session *>(p)->memory->trim();
+}
+
+void *flucurl_session_create_template(void *p, RequestTemplate base) {
+  auto *session = static_cast<Session *>(p);
+  auto *request_template = new TemplateData();
+  request_template->url = curl_url();
+  if (!base.base_url ||
+      curl_url_set(request_template->url, CURLUPART_URL, base.base_url, 0) !=
+          CURLUE_OK) {
+    request_template->release();
+    return nullptr;
+  }
+  request_template->method = base.method ? base.method : "GET";
+  for (int i = 0; i < base.header_count; i++) {
+    request_template->headers =
+        curl_slist_append(request_template->headers, base.headers[i]);
+    request_template->header_names.push_back(header_name(base.headers[i]));
+  }
+  request_template->host = host_hash(base.base_url);
+  std::string_view host;
+  if (url_authority(base.base_url, host, request_template->port)) {
+    request_template->host_name = host;
+  }
+  std::lock_guard lock(session->templates_mutex);
+  session->templates.push_back(request_template);
+  return request_template;
+}
+
+void flucurl_session_preconnect(void *p, const char *url, int count) {
+  if (url) {
+    static_cast<Session *>(p)->preconnect(url, count);
+  }
+}
+
+void flucurl_session_prefetch_dns(void *p, const char **hosts,
+                                  int host_count) {
+  static_cast<Session *>(p)->dns->prefetch(hosts, host_count);
+}
+
+void flucurl_session_remove_template(void *p, void *handle) {
   auto *session = static_cast<Session *>(p);
-  return session->add_request(request, callback, onData, onError);
+  auto *request_template = static_cast<TemplateData *>(handle);
+  {
+    std::lock_guard lock(session->templates_mutex);
+    auto it = std::find(session->templates.begin(), session->templates.end(),
+                        request_template);
+    if (it == session->templates.end()) {
+      return;
+    }
+    session->templates.erase(it);
+  }
+  request_template->release();
 }
 
 void flucurl_global_init() {
@@ -378,18 +3770,47 @@ void flucurl_global_init() {
 
 void flucurl_global_deinit() { curl_global_cleanup(); }
 
+void flucurl_global_set_loop_pool_size(int size) {
+#ifdef FLUCURL_USE_EPOLL
+  std::lock_guard lock(loop_pool_mutex);
+  loop_pool_size = std::clamp(size, 1, 64);
+#endif
+}
+
 void flucurl_free_reponse(Response response) {
-  auto session = static_cast<Session *>(response.session);
-  for (int i = 0; i < response.header_count; i++) {
-    auto header = response.headers[i];
-    header_manager.deallocate(header.p, header.len);
+  if (response.headers) {
+    static_cast<MemoryManager *>(response.memory)
+        ->deallocate_header(response.headers,
+                            response.header_count * sizeof(Header) +
+                                response.header_data_len,
+                            alignof(Header));
+  }
+}
+
+// ASCII only, as header names are
+bool equals_ignore_case(std::string_view a, std::string_view b) {
+  return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                    [](char x, char y) {
+                      return std::tolower(static_cast<unsigned char>(x)) ==
+                             std::tolower(static_cast<unsigned char>(y));
+                    });
+}
+
+int flucurl_response_find_header(Response response, const char *name,
+                                 int from) {
+  for (int i = std::max(from, 0); i < response.header_count; i++) {
+    auto &header = response.headers[i];
+    if (equals_ignore_case({response.header_data + header.name,
+                            static_cast<size_t>(header.name_len)},
+                           name)) {
+      return i;
+    }
   }
-  delete[] response.headers;
+  return -1;
 }
 void flucurl_free_bodydata(BodyData *body_data) {
   auto *session = static_cast<Session *>(body_data->session);
-  body_manager.deallocate(body_data->data, body_data->size);
-  body_data_pool.release_item(body_data);
+  static_cast<Slab *>(body_data->slab)->release();
 }
 
 void flucurl_unlock_upload(UploadState s) {
@@ -404,11 +3825,11 @@ void flucurl_lock_upload(UploadState s) {
 
 size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
   size_t total_size = size * nmemb;
-  auto state = static_cast<UploadState *>(userdata);
-  auto mtx = static_cast<std::mutex *>(state->mtx);
-  auto queue = static_cast<std::queue<Field> *>(state->queue);
-  auto session = static_cast<Session *>(state->session);
-  std::unique_lock lk{*mtx};
+  auto *task = static_cast<TaskData *>(userdata);
+  auto *state = &task->upload_state;
+  auto *queue = &task->upload_queue;
+  auto *session = task->session;
+  std::unique_lock lk{task->upload_mutex};
   if (queue->empty()) {
     state->pause = true;
     return CURL_READFUNC_PAUSE;
@@ -433,78 +3854,141 @@ size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
   }
   return len;
 }
-void flucurl_upload_append(UploadState s, Field f) {
-  auto mtx = static_cast<std::mutex *>(s.mtx);
-  auto queue = static_cast<std::queue<Field> *>(s.queue);
-  std::unique_lock<std::mutex> lk{*mtx};
-  queue->push(f);
-  s.pause = false;
-  curl_easy_pause(s.curl, CURLPAUSE_CONT);
+int flucurl_upload_append(UploadState s, Field f) {
+  auto *task = static_cast<TaskData *>(s.queue);
+  std::unique_lock lock(task->upload_mutex);
+  if (s.request_id == 0 || task->upload_state.request_id != s.request_id) {
+    // the request finished, its record may serve another one by now
+    return 0;
+  }
+  task->upload_queue.push(f);
+  bool paused = task->upload_state.pause;
+  task->upload_state.pause = false;
+  auto *shard = task->shard;
+  lock.unlock();
+  if (paused) {
+    // curl_easy_pause belongs to the worker thread
+    shard->resume_upload(s.request_id);
+  }
+  return 1;
+}
+
+// drops body data that was never sent
+void release_upload(TaskData *task) {
+  if (!task->has_body) {
+    return;
+  }
+  std::lock_guard lock(task->upload_mutex);
+  while (!task->upload_queue.empty()) {
+    auto field = task->upload_queue.front();
+    task->upload_queue.pop();
+    if (field.p) {
+      task->session->config.free_dart_memory(field.p);
+    }
+  }
+  task->upload_state.session = nullptr;
+  task->upload_state.pause = 0;
+  task->upload_state.cur = 0;
+  task->upload_state.request_id = 0;
+}
+
+// packs the headers of the response into one block, see Response::headers
+void pack_headers(TaskData *task) {
+  auto &response = task->response;
+  auto *memory = task->session->memory;
+  response.memory = memory;
+  response.headers = nullptr;
+  response.header_count = task->headers.size();
+  response.header_data = nullptr;
+  response.header_data_len = task->header_data.size();
+  if (task->headers.empty()) {
+    return;
+  }
+  auto table_size = task->headers.size() * sizeof(Header);
+  auto *block = static_cast<char *>(memory->allocate_header(
+      table_size + task->header_data.size(), alignof(Header)));
+  std::memcpy(block, task->headers.data(), table_size);
+  std::memcpy(block + table_size, task->header_data.data(),
+              task->header_data.size());
+  response.headers = reinterpret_cast<Header *>(block);
+  response.header_data = block + table_size;
+  task->headers.clear();
+  task->header_data.clear();
 }
 
 size_t write_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
   auto *cb_data = static_cast<TaskData *>(userdata);
   if (cb_data->response.status) {
-    auto *header = new Field[cb_data->header_entries.size()];
-    std::copy(cb_data->header_entries.begin(), cb_data->header_entries.end(),
-              header);
-    cb_data->response.headers = header;
-    cb_data->response.header_count = cb_data->header_entries.size();
-    cb_data->callback(cb_data->response);
-    cb_data->response.status = 0;
+    cb_data->shard->deliver_response(cb_data);
   }
   size_t total_size = size * nmemb;
-  auto *body_ptr = static_cast<char *>(ptr);
-  auto *data = body_manager.allocate(total_size);
-  std::copy(body_ptr, body_ptr + total_size, static_cast<char *>(data));
-
-  BodyData *body_data = body_data_pool.acquire_item();
-  body_data->session = cb_data->session;
-  body_data->data = static_cast<char *>(data);
-  body_data->size = total_size;
-  cb_data->onData(body_data);
+  cb_data->shard->deliver_body(cb_data, static_cast<char *>(ptr), total_size);
   return total_size;
 }
 
-size_t header_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
-  auto *header_data = static_cast<TaskData *>(userdata);
-  int total_size = size * nmemb;
-  auto *header_line = static_cast<char *>(ptr);
-  if (std::strncmp(header_line, "\r\n", 2) == 0) {
-    // skip empty line
-    return total_size;
+// "HTTP/1.1 200 OK", the version is kept if unknown
+void parse_status_line(std::string_view line, Response &response) {
+  line.remove_prefix(5);
+  auto version = line.substr(0, line.find(' '));
+  if (version == "1.1") {
+    response.http_version = HTTP1_1;
+  } else if (version == "2") {
+    response.http_version = HTTP2;
+  } else if (version == "3") {
+    response.http_version = HTTP3;
+  } else if (version == "1.0") {
+    response.http_version = HTTP1_0;
   }
-  if (std::strncmp(header_line, "HTTP/", 5) == 0) {
-    // possibly a http message header
-    bool yes = false;
-    int status_code;
-    // std::cout << header_line << std::endl;
-    std::istringstream sin(header_line);
-    std::string version;
-    sin >> version >> status_code;
-    header_data->response.status = status_code;
-    if (std::strncmp(header_line + 5, "1.1 ", 4) == 0) {
-      header_data->response.http_version = HTTP1_1;
-    } else if (std::strncmp(header_line + 5, "2 ", 2) == 0) {
-      header_data->response.http_version = HTTP2;
-
-    } else if (std::strncmp(header_line + 5, "3 ", 2) == 0) {
-      header_data->response.http_version = HTTP3;
-
-    } else if (std::strncmp(header_line + 5, "1.0 ", 4) == 0) {
-      header_data->response.http_version = HTTP1_0;
+  line.remove_prefix(version.size());
+  while (!line.empty() && line.front() == ' ') {
+    line.remove_prefix(1);
+  }
+  int status = 0;
+  for (char c : line) {
+    if (c < '0' || c > '9') {
+      break;
     }
-    return total_size;
+    status = status * 10 + (c - '0');
   }
+  response.status = status;
+}
 
-  void *data = header_manager.allocate(total_size - 2);
-  char *header_kv = static_cast<char *>(data);
-
+size_t header_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
+  auto *task = static_cast<TaskData *>(userdata);
+  task->first_byte_received = true;
+  size_t total_size = size * nmemb;
+  std::string_view line(static_cast<char *>(ptr), total_size);
   // strip the trailing "\r\n"
-  std::copy(header_line, header_line + total_size - 2, header_kv);
-
-  header_data->header_entries.push_back(
-      {.p = header_kv, .len = total_size - 2});
-
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+    line.remove_suffix(1);
+  }
+  if (line.empty()) {
+    // the empty line ending the headers
+    return total_size;
+  }
+  if (line.starts_with("HTTP/")) {
+    // a new response, e.g. after a redirect or 100 Continue, only the
+    // headers of the last one are kept
+    parse_status_line(line, task->response);
+    task->header_data.clear();
+    task->headers.clear();
+    return total_size;
+  }
+  auto colon = line.find(':');
+  if (colon == std::string_view::npos) {
+    return total_size;
+  }
+  auto value = line.substr(colon + 1);
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+    value.remove_prefix(1);
+  }
+  while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+    value.remove_suffix(1);
+  }
+  int base = task->header_data.size();
+  task->header_data.append(line);
+  task->headers.push_back({base, static_cast<int>(colon),
+                           base + static_cast<int>(value.data() - line.data()),
+                           static_cast<int>(value.size())});
   return total_size;
 }
\ No newline at end of file
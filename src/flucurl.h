@@ -13,32 +13,92 @@ typedef struct Field {
   int len;
 } Field;
 
+/// Pending requests are served strictly by priority class, hosts within a
+/// class are served fairly.
+enum RequestPriority { PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW };
+
 typedef struct Request {
   const char *url;
   const char *method;
+  /// Bytes of the request body, sent with flucurl_upload_append. Requests
+  /// without a body skip the upload machinery, GET and HEAD use curl's
+  /// native methods.
   int content_length;
   char **headers;
   int header_count;
+  /// Address to connect to instead of resolving the host of url, e.g. from
+  /// a custom resolver. Null to resolve it.
   const char *resolved_ip;
   void *mtx;
+  enum RequestPriority priority;
+  /// Total deadline in milliseconds from submission, 0 for none.
+  /// Requests still queued at the deadline are dropped without a handle.
+  int timeout_ms;
+  /// Deadline in milliseconds from submission for the first response byte,
+  /// 0 for none.
+  int first_byte_timeout_ms;
+  /// A handle of flucurl_session_create_template or null. The url is then
+  /// resolved against the template's base url, empty for the base url
+  /// itself. A null method takes the template's and headers are added to the
+  /// template's, replacing those of the same name.
+  void *request_template;
 } Request;
 
+/// What the requests of a template share, see
+/// flucurl_session_create_template.
+typedef struct RequestTemplate {
+  const char *base_url;
+  /// Null for GET.
+  const char *method;
+  char **headers;
+  int header_count;
+} RequestTemplate;
+
 enum HTTPVersion { HTTP1_0, HTTP1_1, HTTP2, HTTP3 };
 
+/// How the session worker drives the multi handle.
+/// - LOOP_POLL: `curl_multi_perform` + `curl_multi_poll`, available everywhere.
+/// - LOOP_SOCKET_ACTION: `curl_multi_socket_action` driven by an epoll set,
+///   only ready sockets are serviced and an idle session sleeps until woken.
+///   Falls back to LOOP_POLL on platforms without epoll.
+/// - LOOP_SHARED: like LOOP_SOCKET_ACTION, but driven by the process wide
+///   loop pool together with other sessions instead of a thread per worker.
+///   See flucurl_global_set_loop_pool_size.
+enum LoopMode { LOOP_POLL, LOOP_SOCKET_ACTION, LOOP_SHARED };
+
+/// A response header, "name: value" with the value trimmed. Name and value
+/// are offsets into Response::header_data and not null terminated.
+typedef struct Header {
+  int name;
+  int name_len;
+  int value;
+  int value_len;
+} Header;
+
 typedef struct Response {
   enum HTTPVersion http_version;
   int status;
-  Field *headers;
+  /// The headers of the final response in the order received, followed by
+  /// the header_data they point into, in one block freed by
+  /// flucurl_free_reponse.
+  Header *headers;
   int header_count;
-  void *session;
+  char *header_data;
+  int header_data_len;
+  /// The response memory of the session the block came from, for
+  /// flucurl_free_reponse. It stays valid after the session is freed and is
+  /// not a session.
+  void *memory;
 } Response;
 
 typedef struct TLSConfig {
+  /// Apply this config, 0 for curl's defaults.
   int enable;
   /// Enable certificate verification.
   int verify_certificates;
 
   /// Enable TLS Server Name Indication (SNI).
+  /// Not applied, curl always sends it for host names.
   int enable_sni;
 
   /// The trusted root certificates in PEM format.
@@ -46,11 +106,29 @@ typedef struct TLSConfig {
   /// certificate chain.
   /// The Rust API currently doesn't support trusting a single leaf certificate.
   /// Hint: PEM format starts with `-----BEGIN CERTIFICATE-----`.
+  /// They replace the system store and are parsed once per session.
   const char **trusted_root_certificates;
 
   int trusted_root_certificates_length;
 } TLSConfig;
 
+/// How results reach the caller.
+/// - DELIVERY_CALLBACK: the callbacks passed to flucurl_session_send_request
+///   are called from the worker thread for every event.
+/// - DELIVERY_RING: workers queue events and call Config::event_notify once
+///   per batch, the caller drains them with flucurl_session_poll_events.
+/// - DELIVERY_PORT: workers post every event to the Dart port
+///   Config::event_port as a list [request id, EventType, payload...]:
+///   - EVENT_RESPONSE: status, HTTPVersion, then two Uint8List: the Header
+///     table in native byte order (4 int32 per header) and the header_data
+///     its offsets point into, as in Response.
+///   - EVENT_DATA: the chunk as external Uint8List, or null once the body is
+///     complete. The chunk is freed by its finalizer.
+///   - EVENT_ERROR: the message.
+enum DeliveryMode { DELIVERY_CALLBACK, DELIVERY_RING, DELIVERY_PORT };
+
+typedef void (*EventNotifyCallback)(void);
+
 typedef struct Config {
   /// Timeout in seconds.
   int timeout;
@@ -71,14 +149,110 @@ typedef struct Config {
 
   void (*free_dart_memory)(void *);
 
+  enum LoopMode loop_mode;
+
+  /// Number of worker shards, each with its own thread and multi handle.
+  /// Requests are routed to a shard by host. 0 or 1 for a single worker,
+  /// at most max_handles, which is split between the shards.
+  int worker_count;
+
+  /// Maximum number of concurrent transfers, 0 for the default of 50.
+  /// The connection cache is sized to match.
+  int max_handles;
+
+  /// Maximum number of concurrent transfers per host, 0 for no limit.
+  int max_handles_per_host;
+
+  /// Idle easy handles kept even when they time out.
+  int min_idle_handles;
+
+  /// Seconds after which an idle easy handle beyond min_idle_handles is
+  /// freed, 0 for the default of 30.
+  int handle_idle_timeout;
+
+  /// Let every host find its own concurrency limit from time to first byte
+  /// and error rate (AIMD). Requests over the limit stay queued.
+  int adaptive_concurrency;
+
+  /// Bounds of the adaptive limit per host. 0 for 1 and max_handles.
+  int adaptive_min_limit;
+  int adaptive_max_limit;
+
+  /// Seconds without requests after which a worker thread exits, 0 to keep
+  /// it. Workers start on the first request and restart on the next one,
+  /// connections are kept in between.
+  int worker_idle_timeout;
+
+  /// Response body bytes collected before onData is called, 0 to call it
+  /// for every chunk curl receives. Larger chunks mean fewer callbacks.
+  int body_coalesce_bytes;
+
+  /// Milliseconds a partial chunk is held back at most, 0 for 5.
+  int body_coalesce_delay_ms;
+
+  enum DeliveryMode delivery_mode;
+
+  /// DELIVERY_RING only, called from a worker thread when events are ready.
+  /// It is not called again until flucurl_session_poll_events was called.
+  EventNotifyCallback event_notify;
+
+  /// DELIVERY_PORT only, the native port of a Dart ReceivePort and Dart's
+  /// NativeApi.postCObject.
+  long long event_port;
+  void *post_cobject;
+
+  /// Bytes of freed response memory kept for reuse, 0 for the default of
+  /// 4 MB. Memory beyond it goes back to the system.
+  int memory_cache_limit;
+
+  /// Seconds resolved addresses are kept, 0 for the default of 60.
+  int dns_cache_timeout;
+
+  /// Seconds a host that failed to resolve fails further requests right
+  /// away, 0 for the default of 5, negative to always try again.
+  int dns_negative_timeout;
+
+  /// Share DNS entries and TLS sessions with every other session that sets
+  /// it, instead of only within this session. Connections are never shared,
+  /// curl does not support one connection cache used by several threads.
+  int global_share;
+
+  /// Directory the Alt-Svc and HSTS caches are loaded from at start and
+  /// saved to, in curl's file formats, so HTTP/3 upgrades and HSTS survive
+  /// a restart. Created if missing, null to keep them in memory only.
+  const char *state_dir;
+
+  /// Seconds between saves of the state while requests run, 0 for 60.
+  int state_flush_interval;
+
 } Config;
 
+/// A chunk of a response body. It points into a receive buffer shared with
+/// the other chunks of the request, which is freed once
+/// flucurl_free_bodydata was called for all of them.
 typedef struct BodyData {
   char *data;
   int size;
   void *session;
+  void *slab;
 } BodyData;
 
+enum EventType { EVENT_RESPONSE, EVENT_DATA, EVENT_ERROR };
+
+/// A response, body chunk or error of a DELIVERY_RING session, carrying what
+/// the corresponding callback would get.
+typedef struct Event {
+  enum EventType type;
+  unsigned long long request_id;
+  /// EVENT_RESPONSE, to be freed with flucurl_free_reponse.
+  Response response;
+  /// EVENT_DATA, null once the body is complete.
+  BodyData *data;
+  /// EVENT_ERROR, has static storage duration.
+  const char *message;
+} Event;
+
+/// The request body of a running request, see flucurl_upload_append.
 typedef struct UploadState {
   void *session;
   void *queue;
@@ -86,27 +260,111 @@ typedef struct UploadState {
   int pause;
   void *mtx;
   unsigned long long cur;
+  /// The id of the request the state belongs to right now, 0 once it
+  /// finished.
+  unsigned long long request_id;
 } UploadState;
 
+/// Queue wait of requests of one priority class, summed over all workers.
+typedef struct QueueStats {
+  /// Requests that left the queue and started.
+  unsigned long long started;
+  /// Total and maximum time started requests spent queued, in microseconds.
+  unsigned long long total_wait_us;
+  unsigned long long max_wait_us;
+  /// Requests waiting for a handle right now.
+  int pending;
+} QueueStats;
+
+/// Response memory of a session.
+typedef struct MemoryStats {
+  /// Bytes of headers and body chunks not freed yet.
+  unsigned long long outstanding;
+  /// Bytes kept for reuse, see Config::memory_cache_limit.
+  unsigned long long cached;
+} MemoryStats;
+
 typedef void (*ResponseCallback)(Response);
 
 typedef void (*DataHandler)(BodyData *);
 
 typedef void (*ErrorHandler)(const char *message);
 
+typedef void (*ShutdownCallback)(void);
+
 FFI_PLUGIN_EXPORT void flucurl_global_init();
 FFI_PLUGIN_EXPORT void flucurl_global_deinit();
+/// Number of threads of the loop pool used by LOOP_SHARED sessions, 1 by
+/// default. Only has an effect before the first such session is created.
+FFI_PLUGIN_EXPORT void flucurl_global_set_loop_pool_size(int size);
 
-FFI_PLUGIN_EXPORT void flucurl_upload_append(UploadState, Field);
+/// Queues a chunk of the request body, it is freed with
+/// Config::free_dart_memory once sent. Pass a copy of the state taken with
+/// the id returned by flucurl_session_send_request: once that request
+/// finished, the chunk is not taken and 0 is returned.
+FFI_PLUGIN_EXPORT int flucurl_upload_append(UploadState, Field);
 
 FFI_PLUGIN_EXPORT void flucurl_free_reponse(Response);
+/// Index of the first header at or after from named name, compared case
+/// insensitively, -1 if there is none.
+FFI_PLUGIN_EXPORT int flucurl_response_find_header(Response response,
+                                                   const char *name, int from);
 FFI_PLUGIN_EXPORT void flucurl_free_bodydata(BodyData *);
 
 FFI_PLUGIN_EXPORT void *flucurl_session_init(Config config);
 FFI_PLUGIN_EXPORT void flucurl_session_terminate(void *session);
+/// Closes the session without blocking the caller. New requests fail right
+/// away, accepted ones get drain_ms milliseconds to finish and are then
+/// cancelled. The session is freed on a worker thread, which calls callback
+/// once it is gone. The session must not be used after callback.
+FFI_PLUGIN_EXPORT void flucurl_session_shutdown(void *session, int drain_ms,
+                                                ShutdownCallback callback);
+/// request_id, when not null, receives an id for
+/// flucurl_session_cancel_request.
 FFI_PLUGIN_EXPORT UploadState *flucurl_session_send_request(
     void *session, Request request, ResponseCallback callback,
-    DataHandler onData, ErrorHandler onError);
+    DataHandler onData, ErrorHandler onError,
+    unsigned long long *request_id);
+/// Moves up to max_events queued events of a DELIVERY_RING session into
+/// events and returns their number. Keep calling it while it returns
+/// max_events. Must not be called from several threads at once.
+/// Requests rejected by a closing session get no event, their send returns
+/// null instead.
+FFI_PLUGIN_EXPORT int flucurl_session_poll_events(void *session,
+                                                  Event *events,
+                                                  int max_events);
+/// Aborts a queued or running request on the worker thread. The request
+/// gets a final error callback and its handle is freed right away.
+/// Does nothing if the request already finished.
+FFI_PLUGIN_EXPORT void flucurl_session_cancel_request(
+    void *session, unsigned long long request_id);
+FFI_PLUGIN_EXPORT QueueStats flucurl_session_queue_stats(
+    void *session, enum RequestPriority priority);
+FFI_PLUGIN_EXPORT MemoryStats flucurl_session_memory_stats(void *session);
+/// Frees the memory the session keeps for reuse and, where the allocator
+/// supports it, returns free heap memory to the system.
+FFI_PLUGIN_EXPORT void flucurl_session_trim_memory(void *session);
+/// Opens count connections to the host of url ahead of the requests that
+/// will use them, including the TLS handshake and HTTP/2 negotiation. Each
+/// one sends a HEAD request for url at PRIORITY_LOW, its result is dropped.
+/// HTTP/2 may serve all of them over one connection.
+FFI_PLUGIN_EXPORT void flucurl_session_preconnect(void *session,
+                                                  const char *url, int count);
+/// Resolves hosts on a background thread so their first requests skip the
+/// lookup, see Config::dns_cache_timeout. Hosts resolved recently are
+/// skipped.
+FFI_PLUGIN_EXPORT void flucurl_session_prefetch_dns(void *session,
+                                                    const char **hosts,
+                                                    int host_count);
+/// Parses the base url and builds the header list once for all requests
+/// made from the template, see Request::request_template. Returns null if
+/// the base url is invalid. The template is freed with the session unless
+/// it was removed before.
+FFI_PLUGIN_EXPORT void *flucurl_session_create_template(void *session,
+                                                         RequestTemplate base);
+/// Requests using the template keep it alive until they finish.
+FFI_PLUGIN_EXPORT void flucurl_session_remove_template(void *session,
+                                                       void *request_template);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,419 @@
+// Tests of the native core. The translation unit is included so internals
+// like the submission ring can be reached.
+//
+// Build with -DFLUCURL_BUILD_TESTS=ON in src/ and run ctest, or
+//   flucurl_tests [test]
+// to run a single test.
+
+#include "flucurl.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
+static int failures = 0;
+
+#define CHECK(condition)                                                 \
+  do {                                                                   \
+    if (!(condition)) {                                                  \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                   #condition);                                          \
+      failures++;                                                        \
+    }                                                                    \
+  } while (0)
+
+// A capacity of 4 wraps the positions around many times, every value comes
+// out once and in order, and a full ring refuses more.
+static void test_mpsc_ring_wraparound() {
+  MpscRing<int> ring(4);
+  int next_in = 0;
+  int next_out = 0;
+  for (int round = 0; round < 1000; round++) {
+    int burst = round % 5;
+    for (int i = 0; i < burst; i++) {
+      if (ring.try_push(next_in)) {
+        next_in++;
+      }
+    }
+    CHECK(next_in - next_out <= 4);
+    if (next_in - next_out == 4) {
+      CHECK(!ring.try_push(-1));
+    }
+    int pops = round % 3 + 1;
+    int value;
+    for (int i = 0; i < pops && ring.try_pop(value); i++) {
+      CHECK(value == next_out);
+      next_out++;
+    }
+  }
+  int value;
+  while (ring.try_pop(value)) {
+    CHECK(value == next_out);
+    next_out++;
+  }
+  CHECK(next_out == next_in);
+  CHECK(!ring.try_pop(value));
+
+  // several producers wrapping a small ring, each producer's values keep
+  // their order
+  constexpr int producers = 4;
+  constexpr int per_producer = 100000;
+  MpscRing<int> shared(8);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&shared, p] {
+      for (int i = 0; i < per_producer; i++) {
+        while (!shared.try_push(p * per_producer + i)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  std::vector<int> last(producers, -1);
+  for (int received = 0; received < producers * per_producer;) {
+    if (!shared.try_pop(value)) {
+      std::this_thread::yield();
+      continue;
+    }
+    int producer = value / per_producer;
+    CHECK(value % per_producer == last[producer] + 1);
+    last[producer] = value % per_producer;
+    received++;
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  CHECK(!shared.try_pop(value));
+}
+
+// A 10 MB upload needs 161 turns of credit. Next to a host with small
+// requests it starts after 160 turns of theirs, on its own it starts right
+// away without going round empty.
+static void test_scheduler_large_body() {
+  Scheduler scheduler;
+  std::vector<std::unique_ptr<TaskData>> tasks;
+  auto push = [&](uint64_t host, int content_length) {
+    auto task = std::make_unique<TaskData>();
+    task->host = host;
+    task->request.priority = PRIORITY_NORMAL;
+    task->request.content_length = content_length;
+    scheduler.push(task.get());
+    tasks.push_back(std::move(task));
+    return tasks.back().get();
+  };
+  int checks = 0;
+  auto can_start = [&](uint64_t) {
+    checks++;
+    return true;
+  };
+
+  TaskData *upload = push(1, 10 * 1024 * 1024);
+  CHECK(scheduler.pop(can_start) == upload);
+  CHECK(checks < 10);
+  CHECK(scheduler.empty());
+
+  upload = push(1, 10 * 1024 * 1024);
+  for (int i = 0; i < 1000; i++) {
+    push(2, 0);
+  }
+  checks = 0;
+  int position = 0;
+  for (TaskData *task; (task = scheduler.pop(can_start));) {
+    position++;
+    if (task == upload) {
+      break;
+    }
+  }
+  CHECK(position == 641);
+  CHECK(checks < 2000);
+  CHECK(scheduler.size(Scheduler::priority_of(upload->request)) == 360);
+
+  // a host at its limit gets no credit and does not hold the others up
+  while (scheduler.pop(can_start)) {
+  }
+  upload = push(1, 10 * 1024 * 1024);
+  TaskData *small = push(2, 0);
+  CHECK(scheduler.pop([](uint64_t host) { return host == 2; }) == small);
+  CHECK(!scheduler.pop([](uint64_t host) { return host == 2; }));
+  CHECK(scheduler.pop(can_start) == upload);
+}
+
+#ifndef _WIN32
+// Accepts connections and reads their requests without ever answering.
+class SilentServer {
+  int listener;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;
+  int requests = 0;
+  std::vector<int> clients;
+  std::atomic<bool> stopping = false;
+
+  void run() {
+    while (!stopping) {
+      int client = accept(listener, nullptr, nullptr);
+      if (client < 0) {
+        continue;
+      }
+      char buffer[4096];
+      std::string request;
+      while (request.find("\r\n\r\n") == std::string::npos) {
+        auto n = recv(client, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+          break;
+        }
+        request.append(buffer, n);
+      }
+      std::lock_guard lock(mutex);
+      clients.push_back(client);
+      requests++;
+      cv.notify_all();
+    }
+  }
+
+ public:
+  int port = 0;
+
+  SilentServer() {
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    listen(listener, 16);
+    socklen_t length = sizeof(address);
+    getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length);
+    port = ntohs(address.sin_port);
+    thread = std::thread([this] { run(); });
+  }
+
+  ~SilentServer() {
+    stopping = true;
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    thread.join();
+    for (int client : clients) {
+      close(client);
+    }
+  }
+
+  bool wait_requests(int count) {
+    std::unique_lock lock(mutex);
+    return cv.wait_for(lock, seconds(5), [&] { return requests >= count; });
+  }
+
+  int received() {
+    std::lock_guard lock(mutex);
+    return requests;
+  }
+};
+
+static std::mutex errors_mutex;
+static std::condition_variable errors_cv;
+static std::vector<std::string> errors;
+
+static void on_response(Response response) { flucurl_free_reponse(response); }
+
+static void on_data(BodyData *data) {
+  if (data) {
+    flucurl_free_bodydata(data);
+  }
+}
+
+static void on_error(const char *message) {
+  std::lock_guard lock(errors_mutex);
+  errors.push_back(message);
+  errors_cv.notify_all();
+}
+
+static bool wait_errors(size_t count) {
+  std::unique_lock lock(errors_mutex);
+  return errors_cv.wait_for(lock, seconds(5),
+                            [&] { return errors.size() >= count; });
+}
+
+// With one handle the first request runs and the second waits in the
+// queue. Cancelling the queued one fails it without a connection ever being
+// made and leaves the running one alone, cancelling the running one
+// detaches it from its connection.
+static void test_cancel_queued_and_running() {
+  SilentServer server;
+  std::string url = "http://127.0.0.1:" + std::to_string(server.port) + "/";
+
+  Config config = {};
+  config.timeout = 30;
+  config.http_version = HTTP1_1;
+  config.max_handles = 1;
+  void *session = flucurl_session_init(config);
+
+  auto send = [&] {
+    Request request = {};
+    request.url = url.c_str();
+    request.method = "GET";
+    unsigned long long id = 0;
+    flucurl_session_send_request(session, request, on_response, on_data,
+                                 on_error, &id);
+    return id;
+  };
+  auto running = send();
+  CHECK(running != 0);
+  CHECK(server.wait_requests(1));
+  auto queued = send();
+  CHECK(queued != 0);
+
+  flucurl_session_cancel_request(session, queued);
+  CHECK(wait_errors(1));
+  {
+    std::lock_guard lock(errors_mutex);
+    CHECK(errors.size() == 1);
+    CHECK(errors[0] == "Request cancelled");
+  }
+  std::this_thread::sleep_for(milliseconds(100));
+  CHECK(server.received() == 1);
+  {
+    std::lock_guard lock(errors_mutex);
+    CHECK(errors.size() == 1);
+  }
+
+  flucurl_session_cancel_request(session, running);
+  CHECK(wait_errors(2));
+  {
+    std::lock_guard lock(errors_mutex);
+    CHECK(errors.size() == 2);
+    CHECK(errors[1] == "Request cancelled");
+  }
+  // both are gone, cancelling again reports nothing
+  flucurl_session_cancel_request(session, running);
+  flucurl_session_cancel_request(session, queued);
+
+  // the handle is free again for the next request
+  auto next = send();
+  CHECK(server.wait_requests(2));
+  flucurl_session_cancel_request(session, next);
+  CHECK(wait_errors(3));
+
+  flucurl_session_terminate(session);
+  std::lock_guard lock(errors_mutex);
+  errors.clear();
+}
+#endif
+
+// Timers in every level fire on the tick they were scheduled for, after
+// cascading down level by level. Ticks are 1 ms, levels hold 64, 4096 and
+// 262144 ticks.
+static void test_timer_wheel_cascade() {
+  TimerWheel wheel;
+  auto base = steady_clock::now();
+  const std::vector<int> delays = {3, 64, 100, 4095, 4096, 5000, 262143,
+                                   262144, 300000};
+  std::vector<TimerWheel::Node> nodes(delays.size());
+  for (size_t i = 0; i < delays.size(); i++) {
+    nodes[i].data = reinterpret_cast<void *>(i);
+    wheel.schedule(&nodes[i], base + milliseconds(delays[i]));
+  }
+  // cancelled in a high level, it must not come back with the cascade
+  TimerWheel::Node cancelled;
+  wheel.schedule(&cancelled, base + milliseconds(200000));
+  wheel.cancel(&cancelled);
+  // scheduled again further out, only the last time counts
+  TimerWheel::Node moved;
+  wheel.schedule(&moved, base + milliseconds(10));
+  wheel.schedule(&moved, base + milliseconds(70000));
+
+  steady_clock::time_point when;
+  CHECK(wheel.next_expiry(when));
+  CHECK(when <= base + milliseconds(3));
+
+  std::vector<int> fired(delays.size(), -1);
+  int moved_fired = -1;
+  bool cancelled_fired = false;
+  for (int tick = 0; tick <= 300001; tick++) {
+    wheel.advance(base + milliseconds(tick), [&](TimerWheel::Node *node) {
+      if (node == &moved) {
+        moved_fired = tick;
+      } else if (node == &cancelled) {
+        cancelled_fired = true;
+      } else {
+        fired[reinterpret_cast<size_t>(node->data)] = tick;
+      }
+    });
+  }
+  for (size_t i = 0; i < delays.size(); i++) {
+    if (fired[i] != delays[i]) {
+      std::fprintf(stderr, "timer of %d ms fired at %d\n", delays[i],
+                   fired[i]);
+    }
+    CHECK(fired[i] == delays[i]);
+  }
+  CHECK(moved_fired == 70000);
+  CHECK(!cancelled_fired);
+  CHECK(wheel.empty());
+  CHECK(!wheel.next_expiry(when));
+}
+
+static void test_spsc_ring_wraparound() {
+  SpscRing<int> ring(4);
+  int next_in = 0;
+  int next_out = 0;
+  for (int round = 0; round < 1000; round++) {
+    while (ring.try_push(next_in)) {
+      next_in++;
+    }
+    CHECK(next_in - next_out == 4);
+    int value;
+    for (int i = 0; i < round % 4 + 1 && ring.try_pop(value); i++) {
+      CHECK(value == next_out);
+      next_out++;
+    }
+  }
+}
+
+// getaddrinfo repeats addresses for every socket type, each is kept once
+// and only whole entries count as repeats.
+static void test_dns_join_addresses() {
+  CHECK(join_addresses({}) == "");
+  CHECK(join_addresses({"10.0.0.1"}) == "10.0.0.1");
+  CHECK(join_addresses({"10.0.0.11", "10.0.0.1", "10.0.0.11", "[::1]",
+                        "10.0.0.1", "[::1]"}) ==
+        "10.0.0.11,10.0.0.1,[::1]");
+  CHECK(join_addresses({"10.0.0.1", "10.0.0.11", "10.0.0.111"}) ==
+        "10.0.0.1,10.0.0.11,10.0.0.111");
+  CHECK(join_addresses({"[::1]", "[::11]", "[::1]"}) == "[::1],[::11]");
+}
+
+int main(int argc, char **argv) {
+  const std::vector<std::pair<std::string, std::function<void()>>> tests = {
+      {"mpsc_ring_wraparound", test_mpsc_ring_wraparound},
+      {"scheduler_large_body", test_scheduler_large_body},
+#ifndef _WIN32
+      {"cancel_queued_and_running", test_cancel_queued_and_running},
+#endif
+      {"timer_wheel_cascade", test_timer_wheel_cascade},
+      {"spsc_ring_wraparound", test_spsc_ring_wraparound},
+      {"dns_join_addresses", test_dns_join_addresses},
+  };
+  flucurl_global_init();
+  bool found = false;
+  for (auto &[name, test] : tests) {
+    if (argc > 1 && name != argv[1]) {
+      continue;
+    }
+    found = true;
+    int before = failures;
+    test();
+    std::printf("%s %s\n", failures == before ? "ok  " : "FAIL", name.c_str());
+  }
+  if (!found) {
+    std::fprintf(stderr, "no test named %s\n", argv[1]);
+    return 1;
+  }
+  return failures == 0 ? 0 : 1;
+}